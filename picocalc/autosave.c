@@ -0,0 +1,348 @@
+//
+// autosave.c - PicoCalc interface, autosave
+//
+// Every few turns the game is appended to a log in the save directory of the
+// story. The first record holds all of dynamic memory, the ones after it only
+// what changed since the one before (XORed and run-length encoded), so most
+// records are a few hundred bytes. Every so often the log is written again
+// with a single full record. A record cut short by a power loss is ignored.
+//
+// To resume, the log is replayed into a Quetzal save when the story is chosen,
+// then restored at the first prompt. The records are taken at the prompt, in
+// the middle of reading a line, so the save is not one RESTORE could load.
+//
+// Each record is an 8 byte header ("ASvF" for a full record, "ASvD" for a
+// delta, then the length of the rest) followed by the IFhd and Stks chunks of
+// a Quetzal save, the PCrd chunk of a quick save (the read going on) and an
+// RMem or DMem chunk: the length of dynamic memory, then the memory or the
+// delta, run-length encoded.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#undef bool
+#include "picocalc_frotz.h"
+
+#define AUTOSAVE_LOG "autosave.log"
+#define AUTOSAVE_TEMP "autosave.tmp"
+#define AUTOSAVE_RESUME "autosave.rsm" // The game rebuilt from the log to resume
+#define AUTOSAVE_COMPACT (32)    // Deltas appended before the log is written again
+#define AUTOSAVE_CHUNK (256)
+
+static struct
+{
+	int turns;       // Turns between autosaves, 0 for none
+	int count;       // Turns since the last autosave
+	int deltas;      // Deltas in the log since the full record
+	zbyte *previous; // Dynamic memory at the last autosave, run-length encoded
+	size_t previous_size;
+	char resume[FAT32_MAX_PATH_LEN]; // The game to restore at the first prompt
+} autosave = {0};
+
+static void autosave_path(const char *dir, const char *name, char *path, size_t size)
+{
+	snprintf(path, size, "%s/%s", dir, name);
+}
+
+static bool autosave_write_record(FILE *file, bool delta, const zbyte *ifhd, size_t ifhd_size,
+								  const zbyte *stks, size_t stks_size, const zbyte *memory, size_t memory_size)
+{
+	zbyte size[4];
+	zbyte read[QUICK_READ_CHUNK];
+	size_t mem_size = 4 + memory_size;
+	size_t read_size = quick_read_chunk(read);
+
+	iff_put32(size, z_header.dynamic_size);
+	return iff_write_header(file, delta ? "ASvD" : "ASvF",
+							ifhd_size + stks_size + read_size + 8 + mem_size + (mem_size & 1)) &&
+		   fwrite(ifhd, 1, ifhd_size, file) == ifhd_size &&
+		   fwrite(stks, 1, stks_size, file) == stks_size &&
+		   fwrite(read, 1, read_size, file) == read_size &&
+		   iff_write_header(file, delta ? "DMem" : "RMem", mem_size) &&
+		   fwrite(size, 1, sizeof(size), file) == sizeof(size) &&
+		   fwrite(memory, 1, memory_size, file) == memory_size &&
+		   ((mem_size & 1) == 0 || fputc(0, file) != EOF);
+}
+
+static void autosave_write(void)
+{
+	size_t image_size;
+	size_t ifhd_size;
+	size_t stks_size;
+	const zbyte *ifhd = NULL;
+	const zbyte *stks = NULL;
+
+	// The header and the stack come from a Quetzal save in RAM
+	char *image = quick_quetzal(&image_size);
+	if (image != NULL)
+	{
+		ifhd = iff_find_chunk((zbyte *)image + 12, image_size - 12, "IFhd", &ifhd_size);
+		stks = iff_find_chunk((zbyte *)image + 12, image_size - 12, "Stks", &stks_size);
+	}
+
+	long size = z_header.dynamic_size;
+	size_t current_size = rle_encode(zmp, NULL, size, NULL);
+	zbyte *current = malloc(current_size);
+	if (ifhd == NULL || stks == NULL || current == NULL)
+	{
+		free(current);
+		free(image);
+		return;
+	}
+	rle_encode(zmp, NULL, size, current);
+
+	// Only what changed since the last autosave, unless it is time to compact
+	zbyte *memory = current;
+	size_t memory_size = current_size;
+	zbyte *previous = NULL;
+	if (autosave.previous != NULL && autosave.deltas < AUTOSAVE_COMPACT && (previous = malloc(size)) != NULL)
+	{
+		rle_reader_t reader;
+		rle_reader_init(&reader, autosave.previous, autosave.previous_size);
+		rle_read(&reader, previous, size);
+
+		size_t delta_size = rle_encode(zmp, previous, size, NULL);
+		zbyte *delta = malloc(delta_size);
+		if (delta != NULL)
+		{
+			rle_encode(zmp, previous, size, delta);
+			memory = delta;
+			memory_size = delta_size;
+		}
+		free(previous);
+	}
+	bool is_delta = memory != current;
+
+	// A delta is appended; a full record replaces the log
+	char path[FAT32_MAX_PATH_LEN];
+	char log[FAT32_MAX_PATH_LEN];
+	autosave_path(f_setup.restricted_path, AUTOSAVE_LOG, log, sizeof(log));
+	autosave_path(f_setup.restricted_path, is_delta ? AUTOSAVE_LOG : AUTOSAVE_TEMP, path, sizeof(path));
+
+	bool written = false;
+	FILE *file = fopen(path, is_delta ? "ab" : "wb");
+	if (file != NULL)
+	{
+		written = autosave_write_record(file, is_delta, ifhd, ifhd_size, stks, stks_size, memory, memory_size);
+		written = fclose(file) == 0 && written;
+	}
+	if (written && !is_delta)
+	{
+		remove(log);
+		if (rename(path, log) != 0)
+		{
+			// The file system cannot rename, write the log in place
+			file = fopen(log, "wb");
+			written = file != NULL &&
+					  autosave_write_record(file, false, ifhd, ifhd_size, stks, stks_size, memory, memory_size);
+			written = (file == NULL || fclose(file) == 0) && written;
+			remove(path);
+		}
+	}
+
+	if (is_delta)
+	{
+		free(memory);
+	}
+	free(image);
+
+	// After a failed write, start the log again, as it may end in a partial record
+	free(autosave.previous);
+	autosave.previous = written ? current : NULL;
+	autosave.previous_size = written ? current_size : 0;
+	autosave.deltas = is_delta ? autosave.deltas + 1 : 0;
+	if (!written)
+	{
+		free(current);
+	}
+}
+
+void autosave_init(int turns)
+{
+	autosave.turns = turns;
+	autosave.count = 0;
+}
+
+void autosave_turn(void)
+{
+	if (autosave.turns <= 0 || ++autosave.count < autosave.turns)
+	{
+		return;
+	}
+	autosave.count = 0;
+	autosave_write();
+}
+
+// Apply a record of the log to the memory rebuilt from it
+static bool autosave_apply(const zbyte *mem, size_t mem_size, bool delta, zbyte **memory, long *memory_size)
+{
+	rle_reader_t reader;
+	long size = iff_get32(mem + 8);
+
+	rle_reader_init(&reader, mem + 12, MIN(iff_get32(mem + 4) - 4, mem_size - 12));
+	if (!delta)
+	{
+		free(*memory);
+		*memory = malloc(size);
+		*memory_size = size;
+		return *memory != NULL && (long)rle_read(&reader, *memory, size) == size;
+	}
+
+	if (*memory == NULL || size != *memory_size)
+	{
+		return false;
+	}
+	zbyte buffer[AUTOSAVE_CHUNK];
+	for (long pos = 0; pos < size;)
+	{
+		size_t n = rle_read(&reader, buffer, MIN(size - pos, AUTOSAVE_CHUNK));
+		if (n == 0)
+		{
+			return false;
+		}
+		rle_xor(*memory + pos, buffer, n);
+		pos += n;
+	}
+	return true;
+}
+
+bool autosave_resume(const char *dir)
+{
+	char path[FAT32_MAX_PATH_LEN];
+	zbyte header[8];
+	zbyte *latest = NULL;
+	zbyte *memory = NULL;
+	long memory_size = 0;
+	size_t ifhd_size = 0;
+	size_t stks_size = 0;
+	size_t read_size = 0;
+	const zbyte *ifhd = NULL;
+	const zbyte *stks = NULL;
+	const zbyte *read = NULL;
+
+	// Should power be lost as the log is written again, after it is removed
+	// and before the new one is renamed, the new one is left in the temporary
+	// file; it is only used when the log has nothing to resume
+	static const char *const names[] = {AUTOSAVE_LOG, AUTOSAVE_TEMP};
+	FILE *file;
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]) && memory == NULL; i++)
+	{
+		free(latest);
+		latest = NULL;
+		autosave_path(dir, names[i], path, sizeof(path));
+		if ((file = fopen(path, "rb")) == NULL)
+		{
+			continue;
+		}
+
+		// Replay the log up to the last complete record
+		while (fread(header, 1, sizeof(header), file) == sizeof(header))
+		{
+			bool delta = memcmp(header, "ASvD", 4) == 0;
+			size_t length = iff_get32(header + 4);
+			size_t mem_size;
+			size_t record_ifhd_size;
+			size_t record_stks_size;
+			size_t record_read_size;
+
+			if (!delta && memcmp(header, "ASvF", 4) != 0)
+			{
+				break;
+			}
+			zbyte *record = malloc(length);
+			if (record == NULL || fread(record, 1, length, file) != length)
+			{
+				free(record);
+				break; // Cut short
+			}
+
+			const zbyte *record_ifhd = iff_find_chunk(record, length, "IFhd", &record_ifhd_size);
+			const zbyte *record_stks = iff_find_chunk(record, length, "Stks", &record_stks_size);
+			const zbyte *record_read = iff_find_chunk(record, length, "PCrd", &record_read_size);
+			const zbyte *mem = iff_find_chunk(record, length, delta ? "DMem" : "RMem", &mem_size);
+			if (record_ifhd == NULL || record_stks == NULL || mem == NULL || mem_size < 12)
+			{
+				free(record);
+				break;
+			}
+			if (!autosave_apply(mem, mem_size, delta, &memory, &memory_size))
+			{
+				// The memory may be partly changed, so nothing can be resumed
+				free(record);
+				free(memory);
+				memory = NULL;
+				break;
+			}
+
+			free(latest);
+			latest = record;
+			ifhd = record_ifhd;
+			ifhd_size = record_ifhd_size;
+			stks = record_stks;
+			stks_size = record_stks_size;
+			read = record_read;
+			read_size = record_read != NULL ? record_read_size : 0;
+		}
+		fclose(file);
+	}
+
+	// Write it as a save, restored at the first prompt
+	bool written = false;
+	if (latest != NULL && memory != NULL)
+	{
+		autosave_path(dir, AUTOSAVE_RESUME, path, sizeof(path));
+		file = fopen(path, "wb");
+		if (file != NULL)
+		{
+			written = iff_write_header(file, "FORM",
+									   4 + ifhd_size + 8 + memory_size + (memory_size & 1) + stks_size + read_size) &&
+					  fwrite("IFZS", 1, 4, file) == 4 &&
+					  fwrite(ifhd, 1, ifhd_size, file) == ifhd_size &&
+					  iff_write_header(file, "UMem", memory_size) &&
+					  fwrite(memory, 1, memory_size, file) == (size_t)memory_size &&
+					  ((memory_size & 1) == 0 || fputc(0, file) != EOF) &&
+					  fwrite(stks, 1, stks_size, file) == stks_size &&
+					  (read == NULL || fwrite(read, 1, read_size, file) == read_size);
+			written = fclose(file) == 0 && written;
+		}
+	}
+	free(latest);
+	free(memory);
+
+	if (written)
+	{
+		strcpy(autosave.resume, path);
+	}
+	return written;
+}
+
+bool autosave_restore(void)
+{
+	if (autosave.resume[0] == '\0')
+	{
+		return false;
+	}
+
+	int success = 0;
+	FILE *file = fopen(autosave.resume, "rb");
+	if (file != NULL)
+	{
+		success = quick_file_restore(file);
+		fclose(file);
+	}
+	remove(autosave.resume);
+	autosave.resume[0] = '\0';
+	if (success <= 0)
+	{
+		os_beep(2);
+		return false;
+	}
+
+	// The screen still shows the start of the story
+	show_message("Resumed from the autosave. Press a key.");
+	os_read_key(0, FALSE);
+	hide_message();
+	return true;
+}
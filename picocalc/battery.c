@@ -0,0 +1,72 @@
+//
+// battery.c - PicoCalc interface, battery level
+//
+
+#include "pico/stdlib.h"
+
+#include "keyboard.h"
+#include "southbridge.h"
+
+#undef bool
+#include "picocalc_frotz.h"
+
+#define BATTERY_SAMPLE_MS (10000) // How often the southbridge is asked for the level
+#define BATTERY_LOW_LEVEL (10)    // Percentage at which the battery is low
+#define BATTERY_CRITICAL_LEVEL (3) // Percentage at which the game is suspended
+#define BATTERY_CHARGING (0x80)    // Flag in the level read from the southbridge
+
+static repeating_timer_t battery_timer;
+static volatile bool battery_due = false; // Set by the timer, read at the next poll
+static uint8_t battery_level = 0;         // Last level read, in percent
+static bool battery_charging = false;
+
+// Only flag that a sample is due (repeating timer callback); the I2C read
+// blocks, so it is not done at interrupt time
+static bool battery_tick(repeating_timer_t *UNUSED(rt))
+{
+	battery_due = true;
+	return true;
+}
+
+static void battery_sample(void)
+{
+	uint8_t value = sb_read_battery();
+	battery_level = value & 0x7F;
+	battery_charging = (value & BATTERY_CHARGING) != 0;
+}
+
+void battery_init(void)
+{
+	battery_sample();
+	add_repeating_timer_ms(BATTERY_SAMPLE_MS, battery_tick, NULL, &battery_timer);
+}
+
+void battery_poll(void)
+{
+	if (!battery_due)
+	{
+		return;
+	}
+	battery_due = false;
+
+	// The keyboard is polled on the same I2C bus from a timer, hold it off
+	keyboard_set_background_poll(false);
+	battery_sample();
+	keyboard_set_background_poll(true);
+}
+
+uint8_t battery_get_level(void)
+{
+	return battery_level;
+}
+
+bool battery_is_low(void)
+{
+	return !battery_charging && battery_level > 0 && battery_level <= BATTERY_LOW_LEVEL;
+}
+
+bool battery_is_critical(void)
+{
+	// A level of zero is read without a battery, when powered from USB
+	return !battery_charging && battery_level > 0 && battery_level <= BATTERY_CRITICAL_LEVEL;
+}
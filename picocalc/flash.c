@@ -0,0 +1,187 @@
+//
+// flash.c - PicoCalc interface, stories installed in flash
+//
+// The stories and their catalogue are kept in a store, see flash_store.c,
+// read in place and written through its erase and program functions.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+
+#undef bool
+#include "picocalc_frotz.h"
+
+#define STORE_MAGIC (0x4F54535AU) // "ZSTO"
+#define STORE_UNUSED (0xFFFF)     // Erased flash
+#define STORE_ENTRIES ((FLASH_SECTOR_SIZE - sizeof(uint32_t) * 4) / sizeof(flash_story_t))
+
+// An installed story, keyed by the release, serial number and checksum in its
+// header. Entries are 16 bytes so that one never crosses a flash page.
+typedef struct
+{
+	uint16_t sector; // First sector of the story in the store
+	uint16_t release;
+	uint32_t length;
+	uint16_t checksum;
+	uint8_t serial[6];
+} flash_story_t;
+
+// The catalogue is the first sector of the store
+typedef struct
+{
+	uint32_t magic;
+	uint32_t reserved[3];
+	flash_story_t stories[];
+} flash_catalogue_t;
+
+static const flash_store_t *store = NULL;
+static const flash_catalogue_t *catalogue = NULL;
+
+// Open the store the first time it is needed, false if there is none
+static bool store_open(void)
+{
+	static bool opened = false;
+
+	if (!opened)
+	{
+		opened = true;
+		store = flash_store_open();
+		catalogue = store != NULL ? (const flash_catalogue_t *)store->base : NULL;
+	}
+	return store != NULL;
+}
+
+static void story_key(const zbyte *header, flash_story_t *key)
+{
+	key->release = (header[H_RELEASE] << 8) | header[H_RELEASE + 1];
+	key->checksum = (header[H_CHECKSUM] << 8) | header[H_CHECKSUM + 1];
+	memcpy(key->serial, &header[H_SERIAL], sizeof(key->serial));
+}
+
+// Start an empty store, forgetting any installed stories
+static void store_format(uint8_t *page)
+{
+	memset(page, 0xFF, FLASH_PAGE_SIZE);
+	*(uint32_t *)page = STORE_MAGIC;
+	store->erase(0, FLASH_SECTOR_SIZE);
+	store->program(0, page, FLASH_PAGE_SIZE);
+}
+
+const zbyte *flash_find_story(const zbyte *header, long *length)
+{
+	flash_story_t key;
+
+	if (!store_open() || catalogue->magic != STORE_MAGIC)
+	{
+		return NULL;
+	}
+
+	story_key(header, &key);
+	for (size_t i = 0; i < STORE_ENTRIES && catalogue->stories[i].sector != STORE_UNUSED; i++)
+	{
+		const flash_story_t *story = &catalogue->stories[i];
+		if (story->release == key.release && story->checksum == key.checksum &&
+			memcmp(story->serial, key.serial, sizeof(key.serial)) == 0)
+		{
+			*length = story->length;
+			return store->base + story->sector * FLASH_SECTOR_SIZE;
+		}
+	}
+	return NULL;
+}
+
+flash_result_t flash_install_story(const char *path, void (*progress)(int percent))
+{
+	zbyte header[64];
+	long length;
+
+	if (!store_open())
+	{
+		return FLASH_NO_STORE;
+	}
+
+	// Install the story as the interpreter sees it, unpacked and without the
+	// rest of a Blorb file
+	FILE *file = story_open(path);
+	if (file == NULL)
+	{
+		return FLASH_READ_ERROR;
+	}
+	if (fseek(file, 0, SEEK_END) != 0 || (length = ftell(file)) < (long)sizeof(header) ||
+		fseek(file, 0, SEEK_SET) != 0 || fread(header, 1, sizeof(header), file) != sizeof(header))
+	{
+		fclose(file);
+		return FLASH_READ_ERROR;
+	}
+
+	if (flash_find_story(header, &length) != NULL)
+	{
+		fclose(file);
+		return FLASH_ALREADY_INSTALLED;
+	}
+
+	uint32_t size = (length + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE;
+	uint8_t *buffer = malloc(FLASH_SECTOR_SIZE);
+	if (size > store->size - FLASH_SECTOR_SIZE || buffer == NULL)
+	{
+		free(buffer);
+		fclose(file);
+		return FLASH_TOO_LARGE;
+	}
+
+	// Stories are stored one after the other, after the catalogue
+	if (catalogue->magic != STORE_MAGIC)
+	{
+		store_format(buffer);
+	}
+	uint32_t offset = FLASH_SECTOR_SIZE;
+	size_t entry = 0;
+	for (; entry < STORE_ENTRIES && catalogue->stories[entry].sector != STORE_UNUSED; entry++)
+	{
+		const flash_story_t *story = &catalogue->stories[entry];
+		offset = (story->sector * FLASH_SECTOR_SIZE) +
+				 (story->length + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE;
+	}
+	if (entry == STORE_ENTRIES || offset + size > store->size)
+	{
+		// Full, start again with this story
+		store_format(buffer);
+		offset = FLASH_SECTOR_SIZE;
+		entry = 0;
+	}
+
+	// Copy the story a sector at a time
+	fseek(file, 0, SEEK_SET);
+	for (uint32_t done = 0; done < (uint32_t)length; done += FLASH_SECTOR_SIZE)
+	{
+		size_t n = fread(buffer, 1, FLASH_SECTOR_SIZE, file);
+		if (n == 0)
+		{
+			free(buffer);
+			fclose(file);
+			return FLASH_READ_ERROR;
+		}
+		memset(buffer + n, 0xFF, FLASH_SECTOR_SIZE - n);
+		store->erase(offset + done, FLASH_SECTOR_SIZE);
+		store->program(offset + done, buffer, FLASH_SECTOR_SIZE);
+		progress(done * 100 / length);
+	}
+	fclose(file);
+
+	// Only then add it to the catalogue, so a story is never found half copied
+	flash_story_t story = {.sector = offset / FLASH_SECTOR_SIZE, .length = length};
+	story_key(header, &story);
+
+	uint32_t at = offsetof(flash_catalogue_t, stories) + entry * sizeof(flash_story_t);
+	uint32_t page = at & ~(FLASH_PAGE_SIZE - 1);
+	memcpy(buffer, (const uint8_t *)catalogue + page, FLASH_PAGE_SIZE);
+	memcpy(buffer + (at - page), &story, sizeof(story));
+	store->program(page, buffer, FLASH_PAGE_SIZE);
+
+	free(buffer);
+	return FLASH_INSTALLED;
+}
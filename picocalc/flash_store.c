@@ -0,0 +1,48 @@
+//
+// flash_store.c - PicoCalc interface, the flash stories are installed in
+//
+// The second half of flash, read through XIP. It is only used if the
+// interpreter ends before it.
+//
+
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+
+#undef bool
+#include "picocalc_frotz.h"
+
+#define STORE_OFFSET (PICO_FLASH_SIZE_BYTES / 2)
+
+extern char __flash_binary_end; // End of the interpreter, from the linker script
+
+// Interrupts are off while the flash is busy as the handlers run from flash
+static void store_erase(uint32_t offset, size_t size)
+{
+	uint32_t interrupts = save_and_disable_interrupts();
+	flash_range_erase(STORE_OFFSET + offset, size);
+	restore_interrupts(interrupts);
+}
+
+static void store_program(uint32_t offset, const zbyte *data, size_t size)
+{
+	uint32_t interrupts = save_and_disable_interrupts();
+	flash_range_program(STORE_OFFSET + offset, data, size);
+	restore_interrupts(interrupts);
+}
+
+static const flash_store_t flash_store = {
+	.base = (const zbyte *)(XIP_BASE + STORE_OFFSET),
+	.size = PICO_FLASH_SIZE_BYTES - STORE_OFFSET,
+	.erase = store_erase,
+	.program = store_program,
+};
+
+const flash_store_t *flash_store_open(void)
+{
+	if ((uintptr_t)&__flash_binary_end > XIP_BASE + STORE_OFFSET)
+	{
+		return NULL; // The interpreter has grown into the store
+	}
+	return &flash_store;
+}
@@ -0,0 +1,54 @@
+//
+// iff.c - PicoCalc interface, IFF chunks
+//
+// Quetzal saves are IFF files; the port adds its own chunks to them.
+//
+
+#include <stdio.h>
+#include <string.h>
+
+#undef bool
+#include "picocalc_frotz.h"
+
+uint32_t iff_get32(const zbyte *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+void iff_put32(zbyte *p, uint32_t value)
+{
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+const zbyte *iff_find_chunk(const zbyte *data, size_t size, const char *id, size_t *length)
+{
+	size_t pos = 0;
+
+	while (pos + 8 <= size)
+	{
+		size_t chunk_size = iff_get32(data + pos + 4);
+		if (pos + 8 + chunk_size > size)
+		{
+			break;
+		}
+		if (memcmp(data + pos, id, 4) == 0)
+		{
+			*length = MIN(8 + chunk_size + (chunk_size & 1), size - pos);
+			return data + pos;
+		}
+		pos += 8 + chunk_size + (chunk_size & 1);
+	}
+	return NULL;
+}
+
+bool iff_write_header(FILE *file, const char *id, size_t size)
+{
+	zbyte header[8];
+
+	memcpy(header, id, 4);
+	iff_put32(header + 4, size);
+	return fwrite(header, 1, sizeof(header), file) == sizeof(header);
+}
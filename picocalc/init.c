@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdarg.h>
 #include "pico/stdlib.h"
 #include "hardware/watchdog.h"
@@ -16,6 +17,7 @@
 #include "fat32.h"
 #include "keyboard.h"
 #include "lcd.h"
+#include "font.h"
 #include "southbridge.h"
 
 #include "frotz-banner.h"
@@ -26,10 +28,38 @@
 
 uint8_t columns = 40;
 uint16_t phosphor = DEFAULT_PHOSPHOR;						  // Default phosphor type
+int undo_budget = UNDO_AUTO;								  // Undo budget of the selected story
 static char selected_story[FAT32_MAX_PATH_LEN] = {0};		  // Selected story name
 static char save_path[FAT32_MAX_PATH_LEN] = "/Stories/saves"; // Default save path
 
-static char template[MAX_DISPLAY_FILENAME_LEN + 1];
+static char filter[CONFIG_MAX_FILENAME_LEN] = {0}; // Typed prefix to filter the story list
+
+// The memory plan of the highlighted story, made while waiting for keys
+static plan_t plan;
+static char plan_path[FAT32_MAX_PATH_LEN] = {0};
+static bool planned = false;
+
+// What is shown on each row of the story list, so only rows that change are redrawn
+#define ROW_BLANK (-1)
+#define ROW_STORY_MASK 0xFF
+#define ROW_HIGHLIGHT 0x100
+#define ROW_MORE_ABOVE 0x200
+#define ROW_MORE_BELOW 0x400
+static int16_t page_rows[CONFIG_MAX_STORIES_PER_SCREEN];
+static int page_top = 0;	  // Story shown on the top row
+static int page_scrolled = 0; // Rows the list area is scrolled on the panel
+
+static const char *ini_name = "/Stories/settings.ini";
+
+// Scan of the /Stories directory, finished while the selector is shown
+static struct
+{
+	fat32_file_t dir;
+	bool active;
+	config_t *config;
+	view_t *view;
+	int top;
+} scan = {0};
 
 // Function to handle system exit
 void _exit(int status)
@@ -57,6 +87,7 @@ static char *create_filename(const char *base, const char *extension)
 }
 
 // Function to compare two strings for sorting story names (qsort callback)
+// Ignore case so that the stories starting with the filter are together
 static int story_cmp(const void *a, const void *b)
 {
 	story_t *story_a = (story_t *)a;
@@ -64,7 +95,7 @@ static int story_cmp(const void *a, const void *b)
 	const char *sa = (const char *)story_a->story_filename;
 	const char *sb = (const char *)story_b->story_filename;
 
-	return strcmp(sa, sb);
+	return strcasecmp(sa, sb);
 }
 
 static void basic_quit(const char *message)
@@ -94,6 +125,14 @@ static void show_ext(char *file_name)
 	file_name[strlen(file_name)] = '.';
 }
 
+// Build the full path to a story file (the extension is hidden in the name)
+static void story_path(story_t *story, char *path, size_t size)
+{
+	show_ext(story->story_filename);
+	snprintf(path, size, "/Stories/%s", story->story_filename);
+	hide_ext(story->story_filename);
+}
+
 static void update_settings_display(int top, int selected, story_t *story, uint32_t defaults)
 {
 	char buffer[FAT32_MAX_PATH_LEN] = {0};
@@ -139,6 +178,63 @@ static void update_settings_display(int top, int selected, story_t *story, uint3
 		lcd_putstr(56, top + 9, "White");
 	}
 	lcd_set_foreground(FOREGROUND_COLOUR);
+
+	// The memory plan, once the story has been looked at
+	static const char *modes[] = {"Flash", "RAM", "Packed", "SD card", "Too big"};
+	story_path(story, buffer, sizeof(buffer));
+	if (planned && strcmp(buffer, plan_path) == 0)
+	{
+		snprintf(buffer, sizeof(buffer), "%-8s", modes[plan.mode]);
+		lcd_putstr(56, top + 17, buffer);
+		if (plan.undo_levels > 0)
+		{
+			snprintf(buffer, sizeof(buffer), "%-8d", plan.undo_levels);
+		}
+		else
+		{
+			snprintf(buffer, sizeof(buffer), "%-8s", "None");
+		}
+		lcd_putstr(56, top + 19, buffer);
+	}
+	else
+	{
+		lcd_putstr(56, top + 17, "        ");
+		lcd_putstr(56, top + 19, "        ");
+	}
+}
+
+// Plan how the story is loaded, if it was not the last one planned
+static bool story_plan_update(story_t *story)
+{
+	char path[FAT32_MAX_PATH_LEN];
+
+	story_path(story, path, sizeof(path));
+	if (strcmp(path, plan_path) == 0)
+	{
+		return false;
+	}
+	strncpy(plan_path, path, sizeof(plan_path) - 1);
+	planned = story_plan(path, story->undo_budget, &plan);
+	return true;
+}
+
+static void settings_labels(int top)
+{
+	lcd_set_font(&font_5x10);
+	lcd_set_underscore(true);
+	lcd_putc(46, top + 7, 'F');
+	lcd_putc(46, top + 9, 'P');
+	lcd_putstr(46, top + 11, "Enter");
+	lcd_putc(46, top + 13, 'I');
+	lcd_putc(46, top + 15, 'R');
+	lcd_set_underscore(false);
+	lcd_putstr(47, top + 7, "ont:");
+	lcd_putstr(47, top + 9, "hosphor:");
+	lcd_putstr(52, top + 11, "to start");
+	lcd_putstr(47, top + 13, "nstall in flash");
+	lcd_putstr(47, top + 15, "esume autosave");
+	lcd_putstr(46, top + 17, "Memory:");
+	lcd_putstr(46, top + 19, "Undo:");
 }
 
 void settings_set_value(uint32_t *settings, const char *name, const char *value)
@@ -171,6 +267,16 @@ void settings_set_value(uint32_t *settings, const char *name, const char *value)
 	}
 }
 
+static int undo_budget_value(const char *value)
+{
+	if (strcmp(value, "off") == 0 || strcmp(value, "\"off\"") == 0)
+	{
+		return UNDO_OFF;
+	}
+	int budget = atoi(value);
+	return budget > 0 ? budget : UNDO_AUTO;
+}
+
 void config_write(config_t *config, FILE *file)
 {
 	fprintf(file, "# The settings.ini file for Frotz configuration\n");
@@ -211,13 +317,19 @@ void config_write(config_t *config, FILE *file)
 		fprintf(file, "# savepath=/Stories/Saves\n");
 		fprintf(file, "savepath=%s\n\n", config->default_save_path);
 	}
+	fprintf(file, "# Turns between autosaves, 0 for none\n");
+	fprintf(file, "# autosave=%d\n", DEFAULT_AUTOSAVE_TURNS);
+	fprintf(file, "autosave=%d\n\n", config->autosave_turns);
 
 	// Write individual story settings
 	for (size_t i = 0; i < config->story_count; i++)
 	{
-		if (config->stories[i].settings & SETTINGS_SET)
+		if (config->stories[i].settings & SETTINGS_SET || config->stories[i].undo_budget != UNDO_AUTO)
 		{
 			fprintf(file, "[%s]\n", config->stories[i].story_filename);
+		}
+		if (config->stories[i].settings & SETTINGS_SET)
+		{
 			if (config->stories[i].settings & SETTINGS_COLUMNS_64)
 			{
 				fprintf(file, "columns=64\n");
@@ -239,6 +351,17 @@ void config_write(config_t *config, FILE *file)
 			{
 				fprintf(file, "phosphor=white\n");
 			}
+		}
+		if (config->stories[i].undo_budget == UNDO_OFF)
+		{
+			fprintf(file, "undo=off\n");
+		}
+		else if (config->stories[i].undo_budget != UNDO_AUTO)
+		{
+			fprintf(file, "undo=%d\n", config->stories[i].undo_budget);
+		}
+		if (config->stories[i].settings & SETTINGS_SET || config->stories[i].undo_budget != UNDO_AUTO)
+		{
 			fprintf(file, "\n");
 		}
 	}
@@ -251,7 +374,18 @@ int config_handler(void *user, const char *section, const char *name, const char
 
 	if (strcmp(section, "default") == 0)
 	{
-		settings_set_value(&config->defaults, name, value);
+		if (strcmp(name, "savepath") == 0)
+		{
+			strncpy(config->default_save_path, value, sizeof(config->default_save_path) - 1);
+		}
+		else if (strcmp(name, "autosave") == 0)
+		{
+			config->autosave_turns = atoi(value);
+		}
+		else
+		{
+			settings_set_value(&config->defaults, name, value);
+		}
 	}
 	else
 	{
@@ -263,8 +397,19 @@ int config_handler(void *user, const char *section, const char *name, const char
 		{
 			if (strcmp(config->stories[i].story_filename, buffer) == 0)
 			{
-				// Found existing story entry
-				settings_set_value(&config->stories[i].settings, name, value);
+				// Found existing story entry, if the settings were not applied already
+				if (!(config->stories[i].settings & SETTINGS_PENDING))
+				{
+					return 1;
+				}
+				if (strcmp(name, "undo") == 0)
+				{
+					config->stories[i].undo_budget = undo_budget_value(value);
+				}
+				else
+				{
+					settings_set_value(&config->stories[i].settings, name, value);
+				}
 				return 1;
 			}
 		}
@@ -272,27 +417,350 @@ int config_handler(void *user, const char *section, const char *name, const char
 	return 1; // Ignore unknown sections
 }
 
-void story_page(config_t *config, int top, int page_start, int selected)
+// Scroll the list area of the panel by one row, the settings beside the
+// list scroll with it and are drawn again in place
+static void story_scroll(int top, int rows)
+{
+	if (rows > 0)
+	{
+		lcd_scroll_up();
+		memmove(&page_rows[0], &page_rows[1], (CONFIG_MAX_STORIES_PER_SCREEN - 1) * sizeof(page_rows[0]));
+		page_rows[CONFIG_MAX_STORIES_PER_SCREEN - 1] = ROW_BLANK;
+	}
+	else
+	{
+		lcd_scroll_down();
+		memmove(&page_rows[1], &page_rows[0], (CONFIG_MAX_STORIES_PER_SCREEN - 1) * sizeof(page_rows[0]));
+		page_rows[0] = ROW_BLANK;
+	}
+	page_scrolled += rows;
+
+	uint16_t left = (MAX_DISPLAY_FILENAME_LEN + 1) * 8;
+	lcd_solid_rectangle(BACKGROUND_COLOUR, left, top * GLYPH_HEIGHT, MAX_SCREEN_WIDTH * 5 - left, CONFIG_MAX_STORIES_PER_SCREEN * GLYPH_HEIGHT);
+	settings_labels(top);
+}
+
+// Apply the settings in the INI file to the stories found since it was last read
+static void config_read(config_t *config)
+{
+	ini_parse(ini_name, config_handler, config);
+	for (size_t i = 0; i < config->story_count; i++)
+	{
+		config->stories[i].settings &= ~SETTINGS_PENDING;
+	}
+}
+
+static bool is_story_file(const char *filename)
 {
+	const char *ext = strrchr(filename, '.');
+	if (ext == NULL)
+	{
+		return false;
+	}
+	return (ext[1] == 'z' && ext[2] >= '1' && ext[2] <= '8' && ext[3] == '\0') || strcmp(ext, ".zlz") == 0 ||
+		   strcmp(ext, ".zblorb") == 0 || strcmp(ext, ".zblb") == 0;
+}
+
+// Read the next few entries of the /Stories directory, adding any story files
+// in order. Returns the index of the story added, or -1.
+static int scan_step(config_t *config)
+{
+	fat32_entry_t dir_entry;
+
+	for (int entries = 0; scan.active && entries < 8; entries++)
+	{
+		fat32_error_t result = fat32_dir_read(&scan.dir, &dir_entry);
+		if (result != FAT32_OK || !dir_entry.filename[0] || config->story_count >= CONFIG_MAX_STORIES)
+		{
+			// All found (or limited to CONFIG_MAX_STORIES), now the settings can be applied
+			fat32_close(&scan.dir);
+			scan.active = false;
+			config_read(config);
+			break;
+		}
+
+		// Check if the file is a Z-machine story file, a Blorb file, or one packed by tools/zlz.py
+		if ((dir_entry.attr & FAT32_ATTR_HIDDEN) || dir_entry.size == 0 || dir_entry.filename[0] == '.' ||
+			!is_story_file(dir_entry.filename))
+		{
+			continue;
+		}
+
+		story_t story = {SETTINGS_PENDING};
+		strncpy(story.story_filename, dir_entry.filename, sizeof(story.story_filename) - 1);
+		hide_ext(story.story_filename);
+
+		// Keep the stories sorted alphabetically
+		int lo = 0;
+		int hi = config->story_count;
+		while (lo < hi)
+		{
+			int mid = (lo + hi) / 2;
+			if (story_cmp(&config->stories[mid], &story) <= 0)
+			{
+				lo = mid + 1;
+			}
+			else
+			{
+				hi = mid;
+			}
+		}
+		memmove(&config->stories[lo + 1], &config->stories[lo], (config->story_count - lo) * sizeof(story_t));
+		config->stories[lo] = story;
+		config->story_count++;
+		return lo;
+	}
+	return -1;
+}
+
+void story_page(config_t *config, view_t *view, int top)
+{
+	// Moving by one story shifts the rows on the panel rather than redrawing them
+	int top_story = view->first + view->page_start;
+	if (top_story == page_top + 1 || top_story == page_top - 1)
+	{
+		story_scroll(top, top_story - page_top);
+	}
+	page_top = top_story;
+
 	lcd_set_font(&font_8x10);
 	for (int i = 0; i < CONFIG_MAX_STORIES_PER_SCREEN; i++)
 	{
-		if (i + page_start < config->story_count)
+		int index = view->page_start + i;
+		int16_t row = ROW_BLANK;
+
+		if (index < view->count)
+		{
+			row = view->first + index;
+			if (index == view->selected)
+			{
+				row |= ROW_HIGHLIGHT;
+			}
+			if (view->page_start > 0 && i == 0)
+			{
+				row |= ROW_MORE_ABOVE;
+			}
+			if (view->page_start + CONFIG_MAX_STORIES_PER_SCREEN < view->count && i == CONFIG_MAX_STORIES_PER_SCREEN - 1)
+			{
+				row |= ROW_MORE_BELOW;
+			}
+		}
+
+		if (row == page_rows[i])
+		{
+			continue; // Already showing this story
+		}
+
+		if (row != ROW_BLANK && page_rows[i] != ROW_BLANK &&
+			((row ^ page_rows[i]) & ~(ROW_MORE_ABOVE | ROW_MORE_BELOW)) == 0)
+		{
+			// Only the scroll indicator changed
+			lcd_putc(MAX_DISPLAY_FILENAME_LEN, top + i, row & ROW_MORE_ABOVE ? 0x81 : row & ROW_MORE_BELOW ? 0x80 : 0x19);
+		}
+		else if (row == ROW_BLANK)
+		{
+			// Erase the row, including the split screen indicator
+			char buffer[MAX_DISPLAY_FILENAME_LEN + 2];
+			snprintf(buffer, sizeof(buffer), "%*s", MAX_DISPLAY_FILENAME_LEN + 1, "");
+			lcd_putstr(0, top + i, buffer);
+		}
+		else
+		{
+			char *story_name = config->stories[view->first + index].story_filename;
+			draw_text(story_name, row & ROW_HIGHLIGHT, top, i, view->page_start, view->selected, view->count);
+		}
+		page_rows[i] = row;
+	}
+}
+
+// Find the stories starting with the filter; the list is sorted ignoring case,
+// so two binary searches give the range. Returns false if nothing matches.
+static bool filter_stories(config_t *config, view_t *view)
+{
+	size_t len = strlen(filter);
+	int lo = 0;
+	int hi = config->story_count;
+
+	// First story not before the filter
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (strncasecmp(config->stories[mid].story_filename, filter, len) < 0)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	int first = lo;
+
+	// First story after the filter
+	hi = config->story_count;
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (strncasecmp(config->stories[mid].story_filename, filter, len) <= 0)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+
+	if (lo == first)
+	{
+		return false;
+	}
+
+	// Keep the selected story if it still matches, and the same stories on the page
+	int current = view->first + view->selected;
+	int top_story = view->first + view->page_start;
+	view->first = first;
+	view->count = lo - first;
+	view->selected = (current >= first && current < lo) ? current - first : 0;
+	view->page_start = MAX(top_story - first, 0);
+
+	// Keep the selected story on the page
+	if (view->selected < view->page_start)
+	{
+		view->page_start = view->selected;
+	}
+	else if (view->selected >= view->page_start + CONFIG_MAX_STORIES_PER_SCREEN)
+	{
+		view->page_start = view->selected - CONFIG_MAX_STORIES_PER_SCREEN + 1;
+	}
+	if (view->page_start > view->count - CONFIG_MAX_STORIES_PER_SCREEN)
+	{
+		view->page_start = MAX(view->count - CONFIG_MAX_STORIES_PER_SCREEN, 0);
+	}
+	return true;
+}
+
+// The line above the story count shows the filter or the progress of an install
+static void show_status(const char *text)
+{
+	char buffer[MAX_SCREEN_WIDTH + 1];
+
+	lcd_set_font(&font_5x10);
+	snprintf(buffer, sizeof(buffer), "%-*s", (int)sizeof(filter) + 7, text);
+	lcd_putstr(0, 30, buffer);
+}
+
+static void show_filter(bool filtering)
+{
+	char buffer[MAX_SCREEN_WIDTH + 1];
+
+	snprintf(buffer, sizeof(buffer), "Find: %s_", filter);
+	show_status(filtering ? buffer : "");
+}
+
+static void install_progress(int percent)
+{
+	char buffer[32];
+
+	snprintf(buffer, sizeof(buffer), "Installing in flash... %d%%", percent);
+	show_status(buffer);
+}
+
+static void show_story_count(config_t *config)
+{
+	char buffer[32];
+
+	lcd_set_font(&font_5x10);
+	snprintf(buffer, sizeof(buffer), "Available stories: %d", config->story_count);
+	lcd_putstr(0, 31, buffer);
+}
+
+// A story was added at index, keep the selection and the rows shown on the same stories
+static void story_added(config_t *config, view_t *view, int index)
+{
+	int current = view->first + view->selected;
+	int top_story = view->first + view->page_start;
+
+	if (current >= index)
+	{
+		current++;
+	}
+	if (view->page_start > 0 && top_story >= index)
+	{
+		top_story++;
+	}
+
+	for (int i = 0; i < CONFIG_MAX_STORIES_PER_SCREEN; i++)
+	{
+		if (page_rows[i] != ROW_BLANK && (page_rows[i] & ROW_STORY_MASK) >= index)
 		{
-			bool highlight = i + page_start == selected;
-			char *story_name = config->stories[i + page_start].story_filename;
-			draw_text(story_name, highlight,  top, i , page_start, selected, config->story_count);
+			page_rows[i]++;
 		}
 	}
+	if (page_top >= index)
+	{
+		page_top++;
+	}
+
+	view->selected = current - view->first;
+	view->page_start = top_story - view->first;
+	filter_stories(config, view);
+}
+
+// Rebuild the latest autosave of the story, to be restored when it starts
+static bool story_resume(config_t *config, story_t *story)
+{
+	char dir[FAT32_MAX_PATH_LEN];
+
+	snprintf(dir, sizeof(dir), "%s/%s", config->default_save_path, story->story_filename);
+	if (!autosave_resume(dir))
+	{
+		show_status("No autosave to resume");
+		return false;
+	}
+	return true;
+}
+
+// Find more stories while waiting for a key, then read the highlighted story ahead
+static bool selector_idle(void)
+{
+	if (!scan.active)
+	{
+		// Plan the highlighted story before reading it ahead, it takes little time
+		story_t *story = &scan.config->stories[scan.view->first + scan.view->selected];
+		if (story_plan_update(story))
+		{
+			update_settings_display(scan.top, scan.view->selected, story, scan.config->defaults);
+			return true;
+		}
+		return story_prefetch_step();
+	}
+
+	int index = scan_step(scan.config);
+	int scrolled = page_scrolled;
+	if (index >= 0)
+	{
+		story_added(scan.config, scan.view, index);
+		story_page(scan.config, scan.view, scan.top);
+		show_story_count(scan.config);
+	}
+	if (!scan.active || page_scrolled != scrolled)
+	{
+		// The settings of the stories found are now known, and a scroll
+		// leaves only their labels
+		story_t *story = &scan.config->stories[scan.view->first + scan.view->selected];
+		update_settings_display(scan.top, scan.view->selected, story, scan.config->defaults);
+	}
+	return true;
 }
 
 void draw_text(char *text, bool highlighted, int top, int offset, int page_start, int selected, int story_count)
 {
-	char buffer[40] = {};
+	char buffer[40];
 	int row = top + offset;
 
-	strncpy(buffer, template, sizeof(buffer) - 1);
-	memcpy(buffer, text, MIN(strlen(text), MAX_DISPLAY_FILENAME_LEN));
+	// Pad the name to clear the rest of the row
+	snprintf(buffer, sizeof(buffer), "%-*.*s", MAX_DISPLAY_FILENAME_LEN + 1, MAX_DISPLAY_FILENAME_LEN, text);
 
 	lcd_set_reverse(highlighted);
 	lcd_putstr(0, row, buffer);
@@ -318,16 +786,20 @@ story_t *select_story(config_t *config)
 {
 	char buffer[FAT32_MAX_PATH_LEN];
 	char ch = '\0';
-	int page_start = 0;
-	int count = config->story_count - 1;
-	int selected = 0;
+	bool filtering = false;
+	view_t view = {0, config->story_count, 0, 0};
+	story_t *story = &config->stories[0];
+	uint8_t battery_shown = 0xFF;
 	int top = 10;
 
-	// Prepare the selection templates
-	for (int i = 0; i <= MAX_DISPLAY_FILENAME_LEN; i++)
+	// Nothing is shown in the list yet, and only the list area scrolls
+	for (int i = 0; i < CONFIG_MAX_STORIES_PER_SCREEN; i++)
 	{
-		template[i] = '\x20';
+		page_rows[i] = ROW_BLANK;
 	}
+	page_top = 0;
+	page_scrolled = 0;
+	lcd_define_scrolling(top * GLYPH_HEIGHT, (SCREEN_HEIGHT - top - CONFIG_MAX_STORIES_PER_SCREEN) * GLYPH_HEIGHT);
 
 	// Display the banner
 	lcd_clear_screen();
@@ -338,142 +810,237 @@ story_t *select_story(config_t *config)
 	uint8_t len = strlen(buffer);
 	uint8_t column = (len <= MAX_SCREEN_WIDTH ? (MAX_SCREEN_WIDTH - len) / 2 : 1);
 	lcd_putstr(column, 8, buffer);
-	snprintf(buffer, sizeof(buffer), "Available stories: %d", config->story_count);
-	lcd_putstr(0, 31, buffer);
+	show_story_count(config);
 	lcd_set_font(columns == 40 ? &font_8x10 : &font_5x10);
 
 	// List available stories from the filesystem
-	story_page(config, top, page_start, selected);
+	story_page(config, &view, top);
 
 	// Place the settings text
-	lcd_set_font(&font_5x10);
-	lcd_set_underscore(true);
-	lcd_putc(46, top + 7, 'F');
-	lcd_putc(46, top + 9, 'P');
-	lcd_putstr(46, top + 11, "Enter");
-	lcd_set_underscore(false);
-	lcd_putstr(47, top + 7, "ont:");
-	lcd_putstr(47, top + 9, "hosphor:");
-	lcd_putstr(52, top + 11, "to start");
+	settings_labels(top);
 
 	// Initial display of settings
-	update_settings_display(top, selected, &config->stories[selected], config->defaults);
+	update_settings_display(top, view.selected, story, config->defaults);
+
+	// Finish the scan, then read the highlighted story ahead, while waiting for keys
+	scan.config = config;
+	scan.view = &view;
+	scan.top = top;
+	set_idle_handler(selector_idle);
+	story_path(story, buffer, sizeof(buffer));
+	story_prefetch(buffer);
 
 	do
 	{
-		// Display battery level for each key press
-		uint8_t battery_level = sb_read_battery() & 0x7F;
-		snprintf(buffer, sizeof(buffer), "Battery: %u%%", battery_level);
-		lcd_set_font(&font_5x10);
-		lcd_putstr(51, 31, buffer);
-
-		// Wait for user input
-		ch = os_read_key(0, false);
+		// Display the battery level when it changes
+		uint8_t battery_level = battery_get_level();
+		if (battery_level != battery_shown)
+		{
+			snprintf(buffer, sizeof(buffer), "Battery: %u%% ", battery_level);
+			lcd_set_font(&font_5x10);
+			lcd_putstr(51, 31, buffer);
+			battery_shown = battery_level;
+		}
 
-		// Redraw the previously selected story in normal style
-		lcd_set_font(&font_8x10);
-		draw_text(config->stories[selected].story_filename, FALSE, top, selected - page_start, page_start, selected, config->story_count);
+		// Wait for user input, waking now and then to refresh the battery level
+		ch = os_read_key(10, false);
+		if (ch == ZC_TIME_OUT)
+		{
+			continue;
+		}
+		story = &config->stories[view.first + view.selected]; // Stories may have been added
 
-		if (ch == ZC_ARROW_UP)
+		if (filtering && ch >= 0x20 && ch < 0x7F)
+		{
+			// Narrow the list, refusing a key that would leave it empty
+			size_t filter_len = strlen(filter);
+			if (filter_len < sizeof(filter) - 1)
+			{
+				filter[filter_len] = ch;
+				filter[filter_len + 1] = '\0';
+				if (!filter_stories(config, &view))
+				{
+					filter[filter_len] = '\0';
+					os_beep(1);
+				}
+				show_filter(filtering);
+			}
+		}
+		else if (filtering && ch == ZC_BACKSPACE)
+		{
+			size_t filter_len = strlen(filter);
+			if (filter_len > 0)
+			{
+				filter[filter_len - 1] = '\0';
+				filter_stories(config, &view);
+			}
+			else
+			{
+				filtering = false;
+			}
+			show_filter(filtering);
+		}
+		else if (ch == '/')
+		{
+			filtering = true;
+			show_filter(filtering);
+		}
+		else if (ch == ZC_ESCAPE)
+		{
+			// Clear the filter and show all the stories
+			filter[0] = '\0';
+			filtering = false;
+			filter_stories(config, &view);
+			show_filter(filtering);
+		}
+		else if (ch == ZC_ARROW_UP)
 		{
-			if (selected > 0)
+			if (view.selected > 0)
 			{
-				if (selected - page_start <= 0)
+				if (view.selected - view.page_start <= 0)
 				{
-					page_start--;
-					story_page(config, top, page_start, selected - 1);
+					view.page_start--;
 				}
-				selected--;
+				view.selected--;
 			}
 		}
 		else if (ch == KEY_PAGE_UP)
 		{
-			if (page_start > 0)
+			if (view.page_start > 0)
 			{
-				page_start -= CONFIG_MAX_STORIES_PER_SCREEN;
-				if (page_start < 0)
+				view.page_start -= CONFIG_MAX_STORIES_PER_SCREEN;
+				if (view.page_start < 0)
 				{
-					page_start = 0;
+					view.page_start = 0;
 				}
-				selected = page_start;
-				story_page(config, top, page_start, selected);
+				view.selected = view.page_start;
 			}
 		}
 		else if (ch == KEY_PAGE_DOWN)
 		{
-			if (page_start + CONFIG_MAX_STORIES_PER_SCREEN <= config->story_count - CONFIG_MAX_STORIES_PER_SCREEN)
+			if (view.page_start + CONFIG_MAX_STORIES_PER_SCREEN <= view.count - CONFIG_MAX_STORIES_PER_SCREEN)
 			{
-				page_start += CONFIG_MAX_STORIES_PER_SCREEN;
-				selected = page_start;
-				story_page(config, top, page_start, selected);
+				view.page_start += CONFIG_MAX_STORIES_PER_SCREEN;
+				view.selected = view.page_start;
 			}
 		}
 		else if (ch == ZC_ARROW_DOWN)
 		{
-			if (selected < config->story_count - 1)
+			if (view.selected < view.count - 1)
 			{
-				if (selected - page_start >= CONFIG_MAX_STORIES_PER_SCREEN - 1)
+				if (view.selected - view.page_start >= CONFIG_MAX_STORIES_PER_SCREEN - 1)
 				{
-					page_start++;
-					story_page(config, top, page_start, selected + 1);
+					view.page_start++;
 				}
-				selected++;
+				view.selected++;
 			}
 		}
-		else if (ch == ZC_RETURN)
+		else if (ch == ZC_RETURN || ((ch == 'r' || ch == 'R') && story_resume(config, story)))
 		{
-			if (selected >= 0 && selected < config->story_count)
+			// The settings of every story are written back, so find them all
+			while (scan.active)
 			{
-				strncpy(selected_story, config->stories[selected].story_filename, sizeof(selected_story) - 1);
-				selected_story[sizeof(selected_story) - 1] = '\0';
-				break;
+				int index = scan_step(config);
+				if (index >= 0)
+				{
+					story_added(config, &view, index);
+				}
 			}
+			story = &config->stories[view.first + view.selected];
+
+			strncpy(selected_story, story->story_filename, sizeof(selected_story) - 1);
+			selected_story[sizeof(selected_story) - 1] = '\0';
+			break;
 		}
 		else if (ch == 'f' || ch == 'F')
 		{
 			// Toggle font size
-			columns = (config->stories[selected].settings & SETTINGS_COLUMNS_64) ? 40 : 64;
-			config->stories[selected].settings &= ~SETTINGS_COLUMNS_MASK;
-			config->stories[selected].settings |= SETTINGS_SET | (columns == 64 ? SETTINGS_COLUMNS_64 : 0);
+			story->settings &= ~SETTINGS_PENDING;
+			columns = (story->settings & SETTINGS_COLUMNS_64) ? 40 : 64;
+			story->settings &= ~SETTINGS_COLUMNS_MASK;
+			story->settings |= SETTINGS_SET | (columns == 64 ? SETTINGS_COLUMNS_64 : 0);
+		}
+		else if (ch == 'i' || ch == 'I')
+		{
+			// Copy the story to flash, where it loads from without the SD card
+			story_prefetch_cancel();
+			plan_path[0] = '\0'; // Planned again, from flash
+			story_path(story, buffer, sizeof(buffer));
+			install_progress(0);
+			switch (flash_install_story(buffer, install_progress))
+			{
+			case FLASH_INSTALLED:
+				show_status("Installed in flash");
+				break;
+			case FLASH_ALREADY_INSTALLED:
+				show_status("Already installed in flash");
+				break;
+			case FLASH_TOO_LARGE:
+				show_status("Too large to install in flash");
+				break;
+			case FLASH_NO_STORE:
+				show_status("No room in flash for stories");
+				break;
+			default:
+				show_status("Could not read the story");
+				break;
+			}
 		}
 		else if (ch == 'p' || ch == 'P')
 		{
-			config->stories[selected].settings &= ~SETTINGS_PHOSPHOR_MASK;
+			story->settings &= ~(SETTINGS_PHOSPHOR_MASK | SETTINGS_PENDING);
 			// Cycle through phosphor types
 			if (phosphor == GREEN_PHOSPHOR)
 			{
 				phosphor = AMBER_PHOSPHOR;
-				config->stories[selected].settings |= SETTINGS_SET | SETTINGS_PHOSPHOR_AMBER;
+				story->settings |= SETTINGS_SET | SETTINGS_PHOSPHOR_AMBER;
 			}
 			else if (phosphor == AMBER_PHOSPHOR)
 			{
 				phosphor = WHITE_PHOSPHOR;
-				config->stories[selected].settings |= SETTINGS_SET;
+				story->settings |= SETTINGS_SET;
 			}
 			else
 			{
 				phosphor = GREEN_PHOSPHOR;
-				config->stories[selected].settings |= SETTINGS_SET | SETTINGS_PHOSPHOR_GREEN;
+				story->settings |= SETTINGS_SET | SETTINGS_PHOSPHOR_GREEN;
 			}
 		}
 
-		// Redraw the newly selected story in selected style
-		lcd_set_font(&font_8x10);
-		draw_text(config->stories[selected].story_filename, TRUE, top, selected - page_start, page_start, selected, config->story_count);
+		// Redraw the rows that changed, with the selected story highlighted
+		story_page(config, &view, top);
+		story = &config->stories[view.first + view.selected];
 
 		// Update story name to point to settings
-		update_settings_display(top, selected, &config->stories[selected], config->defaults);
+		update_settings_display(top, view.selected, story, config->defaults);
+
+		// Read ahead the newly highlighted story (nothing changes if it is the same)
+		story_path(story, buffer, sizeof(buffer));
+		story_prefetch(buffer);
 
 	} while (ch != ZC_RETURN);
 
-	return &config->stories[selected];
+	set_idle_handler(NULL);
+
+	// Put the panel back the way the game expects it
+	for (; page_scrolled > 0; page_scrolled--)
+	{
+		lcd_scroll_down();
+	}
+	for (; page_scrolled < 0; page_scrolled++)
+	{
+		lcd_scroll_up();
+	}
+	lcd_define_scrolling(0, 0);
+
+	return story;
 }
 
 void os_process_arguments(int UNUSED(argc), char *UNUSED(argv[]))
 {
 	char *p;
 
-	f_setup.undo_slots = 20;
+	f_setup.undo_slots = MAX_UNDO_LEVELS; // Until the story is loaded, see os_init_screen()
 	f_setup.format = FORMAT_ANSI;
 
 	// Save the story file name
@@ -552,6 +1119,16 @@ void os_init_screen(void)
 	}
 
 	z_header.interpreter_version = 'F';
+
+	// The story is in memory by now (init_memory() runs before this)
+	story_loaded(z_header.dynamic_size);
+
+	// Undo levels for the memory left, set up after this by init_undo()
+	f_setup.undo_slots = undo_levels(z_header.version, z_header.dynamic_size, heap_free(), undo_budget);
+	if (f_setup.undo_slots == 0)
+	{
+		z_header.flags &= ~UNDO_FLAG;
+	}
 }
 
 int os_random_seed(void)
@@ -563,6 +1140,8 @@ void os_quit(int status)
 {
 	char buffer[2];
 
+	quick_save_flush();
+
 	if (status == EXIT_SUCCESS)
 	{
 		print_string("\n\nGame over. Thanks for playing!\n");
@@ -627,7 +1206,8 @@ void os_fatal(const char *s, ...)
 
 FILE *os_load_story(void)
 {
-	return fopen(f_setup.story_file, "rb");
+	// Uses the copy read ahead in the selector, if there is one
+	return story_open(f_setup.story_file);
 }
 
 int os_storyfile_seek(FILE *fp, long offset, int whence)
@@ -640,74 +1220,36 @@ int os_storyfile_tell(FILE *fp)
 	return ftell(fp);
 }
 
-void os_init_setup(void)
+// Find the stories and let the player choose one
+static story_t *choose_story(config_t *config)
 {
-	sb_init();
-	lcd_init();
-	keyboard_init();
-	audio_init();
-	fat32_init();
-
-	lcd_enable_cursor(false);
-	keyboard_set_background_poll(true);
-
-	config_t config = {0};
-	config.defaults = SETTINGS_SET;
-	strcpy(config.default_save_path, "/Stories/Saves");
-
-	fat32_file_t dir;
-	fat32_error_t result = fat32_open(&dir, "/Stories");
-	if (result != FAT32_OK)
+	if (fat32_open(&scan.dir, "/Stories") != FAT32_OK)
 	{
 		basic_quit("   Error opening /Stories directory!");
 	}
 
-	// Scan for story files in the /Stories directory
-	// and add them to the settings list
-	fat32_entry_t dir_entry;
-	do
+	// Scan for story files in the /Stories directory until there is a
+	// screenful, the selector finds the rest while waiting for keys
+	scan.active = true;
+	while (scan.active && config->story_count < CONFIG_MAX_STORIES_PER_SCREEN)
 	{
-		result = fat32_dir_read(&dir, &dir_entry);
-		if (result == FAT32_OK && dir_entry.filename[0] && (dir_entry.attr & FAT32_ATTR_HIDDEN) == 0)
-		{
-			// Check if the file is a Z-machine story file
-			if (dir_entry.size > 0 && dir_entry.filename[0] != '.')
-			{
-				size_t len = strlen(dir_entry.filename);
-				if (len >= 3 && dir_entry.filename[len - 3] == '.' && dir_entry.filename[len - 2] == 'z' &&
-					dir_entry.filename[len - 1] >= '1' && dir_entry.filename[len - 1] <= '8')
-				{
-					strncpy(
-						config.stories[config.story_count].story_filename,
-						dir_entry.filename,
-						sizeof(config.stories[config.story_count].story_filename) - 1);
-					hide_ext(config.stories[config.story_count].story_filename);
-					config.story_count++;
-					if (config.story_count >= CONFIG_MAX_STORIES)
-					{
-						break; // Limit to CONFIG_MAX_STORIES
-					}
-				}
-			}
-		}
-	} while (dir_entry.filename[0]);
-
-	fat32_close(&dir);
+		scan_step(config);
+	}
 
-	if (config.story_count == 0)
+	if (config->story_count == 0)
 	{
 		lcd_clear_screen();
 		basic_quit("   No story files found in /Stories.");
 	}
 
-	// Sort the stories alphabetically
-	qsort(config.stories, config.story_count, sizeof(story_t), story_cmp);
-
 	// Load default settings and the story settings from the INI file
-	const char *ini_name = "/Stories/settings.ini";
-	ini_parse(ini_name, config_handler, &config);
+	// (done again for the stories found later)
+	if (scan.active)
+	{
+		config_read(config);
+	}
 
-	story_t *story = select_story(&config);
+	story_t *story = select_story(config);
 	if (!selected_story)
 	{
 		os_erase_area(1, 1, SCREEN_HEIGHT, columns, 0);
@@ -721,16 +1263,44 @@ void os_init_setup(void)
 	FILE *ini_file = fopen(ini_name, "w+");
 	if (ini_file)
 	{
-		config_write(&config, ini_file);
+		config_write(config, ini_file);
 		fclose(ini_file);
 	}
 
 	// Construct the full path to the selected story
-	selected_story[0] = '\0';
-	show_ext(story->story_filename);
-	strncat(selected_story, "/Stories/", sizeof(selected_story) - strlen(selected_story) - 1);
-	strncat(selected_story, story->story_filename, sizeof(selected_story) - strlen(selected_story) - 1);
-	hide_ext(story->story_filename);
+	story_path(story, selected_story, sizeof(selected_story));
+	return story;
+}
+
+void os_init_setup(void)
+{
+	sb_init();
+	battery_init();
+	lcd_init();
+	keyboard_init();
+	audio_init();
+	fat32_init();
+
+	lcd_enable_cursor(false);
+	keyboard_set_background_poll(true);
+
+	config_t config = {0};
+	config.defaults = SETTINGS_SET;
+	strcpy(config.default_save_path, "/Stories/Saves");
+	config.autosave_turns = DEFAULT_AUTOSAVE_TURNS;
+
+	fat32_file_t dir;
+	story_t suspended;
+	story_t *story = &suspended;
+	if (suspend_find(selected_story, sizeof(selected_story), &suspended))
+	{
+		// Resume the suspended game, without the selector
+		config_read(&config);
+	}
+	else
+	{
+		story = choose_story(&config);
+	}
 
 	// Apply default settings for the selected story if not set
 	if (!(story->settings & SETTINGS_SET))
@@ -782,6 +1352,9 @@ void os_init_setup(void)
 		fat32_close(&dir);
 	}
 
+	autosave_init(config.autosave_turns);
+	undo_budget = story->undo_budget;
+
 	// Clear the screen for the game
 	os_erase_area(1, 1, SCREEN_HEIGHT, columns, 0);
 	os_set_cursor(1, 1);
@@ -20,6 +20,14 @@ static uint8_t history_head = 0;
 static uint8_t history_tail = 0;
 static uint8_t history_index = 0;
 
+static idle_handler_t idle_handler = NULL; // Background work done while waiting for a key
+
+#define EXT_BACKUP ".bak" // The previous save, kept until a new one is complete
+#define BACKUP_CHUNK (1024)
+
+static char backup_pending[FAT32_MAX_PATH_LEN + 1] = {0}; // A save being written over a backed up one
+#define BATTERY_POLL (50) // Tenths of a second between checks of the battery at a prompt
+
 char *dirname(char *path)
 {
 	if (!path || !*path)
@@ -61,6 +69,11 @@ void history_add(const char *line)
 	}
 }
 
+void set_idle_handler(idle_handler_t handler)
+{
+	idle_handler = handler;
+}
+
 zchar os_read_key(int timeout, bool show_cursor)
 {
 	// timeout is in tenths of seconds, 0 means no timeout
@@ -81,6 +94,11 @@ zchar os_read_key(int timeout, bool show_cursor)
 				break; // timeout!
 			}
 		}
+		battery_poll();
+		if (idle_handler != NULL && idle_handler())
+		{
+			continue; // more to do, check for a key before the next step
+		}
 		tight_loop_contents(); // yield to other tasks
 		sleep_ms(100);		   // sleep for a short time to avoid busy-waiting
 	}
@@ -154,12 +172,119 @@ zchar os_read_key(int timeout, bool show_cursor)
 	}
 }
 
+// A save is complete when its FORM chunk covers the whole file
+static bool save_complete(const char *file_name)
+{
+	zbyte header[12] = {0};
+	long size = -1;
+
+	FILE *fp = fopen(file_name, "rb");
+	if (fp == NULL)
+	{
+		return false;
+	}
+	if (fread(header, 1, sizeof(header), fp) == sizeof(header) && fseek(fp, 0, SEEK_END) == 0)
+	{
+		size = ftell(fp);
+	}
+	fclose(fp);
+
+	long form_size = ((long)header[4] << 24) | (header[5] << 16) | (header[6] << 8) | header[7];
+	return size >= (long)sizeof(header) && memcmp(header, "FORM", 4) == 0 &&
+		   memcmp(header + 8, "IFZS", 4) == 0 && form_size + 8 == size;
+}
+
+// Move a save aside before it is overwritten, copying it if the file system
+// cannot rename
+static void save_backup(const char *file_name, const char *backup)
+{
+	remove(backup);
+	if (rename(file_name, backup) == 0)
+	{
+		return;
+	}
+
+	FILE *from = fopen(file_name, "rb");
+	FILE *to = fopen(backup, "wb");
+	char *buffer = malloc(BACKUP_CHUNK);
+	if (from != NULL && to != NULL && buffer != NULL)
+	{
+		size_t n;
+		while ((n = fread(buffer, 1, BACKUP_CHUNK, from)) > 0 && fwrite(buffer, 1, n, to) == n)
+		{
+		}
+	}
+	free(buffer);
+	if (to != NULL)
+	{
+		fclose(to);
+	}
+	if (from != NULL)
+	{
+		fclose(from);
+	}
+}
+
+// Once the save written after the last backup is complete, the backup is of
+// no use; if it is not, the backup is kept for RESTORE to fall back to
+static void save_backup_done(void)
+{
+	char backup[FAT32_MAX_PATH_LEN + sizeof(EXT_BACKUP)];
+
+	if (backup_pending[0] == '\0')
+	{
+		return;
+	}
+	if (save_complete(backup_pending))
+	{
+		snprintf(backup, sizeof(backup), "%s%s", backup_pending, EXT_BACKUP);
+		remove(backup);
+	}
+	backup_pending[0] = '\0';
+}
+
+// Clear the line typed so far, leaving the cursor at its start
+static void clear_line(int row, int col, int length)
+{
+	lcd_erase_cursor();
+	os_set_cursor(row, col);
+	for (int i = 0; i < length; i++)
+	{
+		os_display_char(' ');
+	}
+	os_set_cursor(row, col);
+}
+
 zchar os_read_line(int max, zchar *buf, int timeout, int width, int continued)
 {
 	zchar key;
 	int row = cursor_row + 1; // Start position of the input line (row)
 	int col = cursor_col + 1; // Start position of the input line (column)
 	static uint8_t index = 0;
+	static bool critical = false; // The game was suspended as the battery ran out
+
+	if (!continued)
+	{
+		quick_read_begin(max);
+		if (suspend_resume() || autosave_restore())
+		{
+			// At the prompt the game was suspended or autosaved at
+			buf[0] = 0;
+			row = cursor_row + 1;
+			col = cursor_col + 1;
+		}
+		else
+		{
+			autosave_turn(); // Before the player's next command
+		}
+		save_backup_done();
+		heap_sample();
+	}
+	max = quick_read_max(); // As long as the read restored allows
+	if (battery_is_low())
+	{
+		show_battery_low();
+	}
 
 	uint8_t length = strlen(buf);
 	if (length == 0)
@@ -184,14 +309,32 @@ zchar os_read_line(int max, zchar *buf, int timeout, int width, int continued)
 			key = ZC_TIME_OUT;
 			break;
 		}
-		key = os_read_key(remaining_timeout, FALSE);
-		if (key == ZC_TIME_OUT)
+		// Without a timeout, wake up now and then to check the battery
+		key = os_read_key(timeout > 0 ? remaining_timeout : BATTERY_POLL, FALSE);
+		if (key == ZC_TIME_OUT && timeout > 0)
 		{
 			break;
 		}
+		if (key == ZC_TIME_OUT)
+		{
+			if (!critical && battery_is_critical())
+			{
+				critical = true;
+				key = ZC_FKEY_F9;
+			}
+			else
+			{
+				if (battery_is_low())
+				{
+					show_battery_low();
+				}
+				continue;
+			}
+		}
 		switch (key)
 		{
 		case '\t': // completion
+		{
 			// Handle tab completion
 			char result[24] = {0};
 
@@ -227,6 +370,7 @@ zchar os_read_line(int max, zchar *buf, int timeout, int width, int continued)
 				}
 			}
 			break;
+		}
 		case ZC_BACKSPACE:
 			if (index > 0)
 			{
@@ -370,6 +514,64 @@ zchar os_read_line(int max, zchar *buf, int timeout, int width, int continued)
 				lcd_draw_cursor();
 			}
 			break;
+		case ZC_FKEY_F1:
+		case ZC_FKEY_F2:
+			// Quick save to the slot of the key, with the screen as it was at
+			// the prompt; the line typed so far is put back after
+			clear_line(row, col, length);
+			os_beep(quick_save(key - ZC_FKEY_F1) ? 1 : 2);
+			os_display_string(buf);
+			os_set_cursor(row, col + index);
+			lcd_draw_cursor();
+			break;
+		case ZC_FKEY_F3:
+		case ZC_FKEY_F4:
+			// Quick restore, to the prompt and the screen of the quick save
+			if (!quick_restore(key - ZC_FKEY_F3))
+			{
+				os_beep(2);
+				break;
+			}
+			index = 0;
+			length = 0;
+			buf[0] = 0;
+			max = quick_read_max();
+			row = cursor_row + 1;
+			col = cursor_col + 1;
+			lcd_draw_cursor();
+			break;
+		case ZC_FKEY_F5:
+		{
+			// Show how the heap is used, until the next key
+			heap_stats_t stats;
+			char message[MAX_SCREEN_WIDTH + 1];
+			heap_stats(&stats);
+			snprintf(message, sizeof(message), "Used %uK (%+dK), peak %uK, free %uK",
+					 (unsigned)(stats.in_use / 1024), (int)(stats.growth / 1024),
+					 (unsigned)(stats.peak / 1024), (unsigned)(stats.free / 1024));
+			show_message(message);
+			os_read_key(0, FALSE);
+			hide_message();
+			os_set_cursor(row, col + index);
+			lcd_draw_cursor();
+			break;
+		}
+#ifdef PICOCALC_PROFILE
+		case ZC_FKEY_F6:
+			// Write the profile to the save directory
+			os_beep(profile_dump() ? 1 : 2);
+			break;
+#endif
+		case ZC_FKEY_F9:
+			// Suspend at an empty prompt, the line typed so far is not kept
+			clear_line(row, col, length);
+			index = 0;
+			length = 0;
+			buf[0] = 0;
+			suspend_game(critical);
+			os_set_cursor(row, col);
+			lcd_draw_cursor();
+			break;
 		case ZC_FKEY_F10:
 			// Handle F10 key press
 			if (phosphor == WHITE_PHOSPHOR)
@@ -435,6 +637,7 @@ char *os_read_file_name(const char *default_name, int flag)
 	FILE *fp;
 	int i;
 	char *tempname;
+	char name[FAT32_MAX_PATH_LEN + 1];
 	zchar answer[4];
 	char path_separator[2];
 	char file_name[FAT32_MAX_PATH_LEN + 1];
@@ -534,7 +737,9 @@ char *os_read_file_name(const char *default_name, int flag)
 	if (f_setup.restricted_path)
 	{
 		tempname = dirname(file_name);
-		if (strlen(tempname) > 1)
+		bool has_path = tempname == NULL || strlen(tempname) > 1;
+		free(tempname);
+		if (has_path)
 		{
 			return NULL;
 		}
@@ -573,7 +778,7 @@ char *os_read_file_name(const char *default_name, int flag)
 				break;
 			}
 		}
-		tempname = strdup(file_name + i);
+		strcpy(name, file_name + i);
 		strncpy(file_name, f_setup.restricted_path, FAT32_MAX_PATH_LEN);
 
 		// Make sure the final character is the path separator.
@@ -581,7 +786,7 @@ char *os_read_file_name(const char *default_name, int flag)
 		{
 			strncat(file_name, path_separator, FAT32_MAX_PATH_LEN - strlen(file_name) - 2);
 		}
-		strncat(file_name, tempname, FAT32_MAX_PATH_LEN - strlen(file_name) - 1);
+		strncat(file_name, name, FAT32_MAX_PATH_LEN - strlen(file_name) - 1);
 	}
 
 	ext = strrchr(file_name, '.');
@@ -636,6 +841,22 @@ char *os_read_file_name(const char *default_name, int flag)
 			return NULL;
 	}
 
+	// Keep the previous save until the new one is written, and fall back to
+	// it if the save being restored was interrupted
+	char backup[FAT32_MAX_PATH_LEN + sizeof(EXT_BACKUP)];
+	snprintf(backup, sizeof(backup), "%s%s", file_name, EXT_BACKUP);
+	save_backup_done();
+	if (flag == FILE_SAVE && save_complete(file_name))
+	{
+		save_backup(file_name, backup);
+		strncpy(backup_pending, file_name, sizeof(backup_pending) - 1);
+	}
+	else if (flag == FILE_RESTORE && !save_complete(file_name) && save_complete(backup))
+	{
+		print_string("That save is incomplete, restoring the one before it.\n");
+		return strdup(backup);
+	}
+
 	return strdup(file_name);
 }
 
@@ -663,5 +884,7 @@ zword os_read_mouse(void)
 
 void os_tick(void)
 {
-	// Nothing to do
+#ifdef PICOCALC_PROFILE
+	profile_tick();
+#endif
 }
\ No newline at end of file
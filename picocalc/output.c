@@ -87,6 +87,71 @@ void update_lcd_display(int top, int left, int bottom, int right)
     }
 }
 
+size_t screen_state_size(void)
+{
+    // Cursor, style and columns, then the character and style of each cell
+    return 4 + MAX_SCREEN_WIDTH * SCREEN_HEIGHT * 2;
+}
+
+void screen_state_get(zbyte *state)
+{
+    state[0] = cursor_row;
+    state[1] = cursor_col;
+    state[2] = text_style;
+    state[3] = columns;
+    for (int i = 0; i < columns * SCREEN_HEIGHT; i++)
+    {
+        state[4 + i * 2] = screen[i] >> 16;
+        state[5 + i * 2] = screen[i] & 0xFF;
+    }
+}
+
+bool screen_state_set(const zbyte *state)
+{
+    if (state[3] != columns || state[0] >= SCREEN_HEIGHT || state[1] >= columns)
+    {
+        return FALSE; // From another font
+    }
+
+    for (int i = 0; i < columns * SCREEN_HEIGHT; i++)
+    {
+        screen[i] = CELL_CH(state[4 + i * 2]) | CELL_STYLE(state[5 + i * 2]);
+    }
+    update_lcd_display(0, 0, SCREEN_HEIGHT - 1, columns - 1);
+    os_set_text_style(state[2]);
+    os_set_cursor(state[0] + 1, state[1] + 1);
+    return TRUE;
+}
+
+void show_message(const char *text)
+{
+    char message[MAX_SCREEN_WIDTH + 1];
+
+    snprintf(message, sizeof(message), "%-*s", columns, text);
+    lcd_erase_cursor();
+    lcd_set_reverse(TRUE);
+    lcd_set_bold(FALSE);
+    lcd_set_underscore(FALSE);
+    lcd_putstr(0, SCREEN_HEIGHT - 1, message);
+}
+
+void hide_message(void)
+{
+    update_lcd_display(SCREEN_HEIGHT - 1, 0, SCREEN_HEIGHT - 1, columns - 1);
+    os_set_text_style(text_style);
+}
+
+// A reverse video '!' in the top right corner, over the status line; it is
+// only drawn on the LCD, so the game writing there replaces it
+void show_battery_low(void)
+{
+    lcd_set_reverse(TRUE);
+    lcd_set_bold(FALSE);
+    lcd_set_underscore(FALSE);
+    lcd_putc(columns - 1, 0, '!');
+    os_set_text_style(text_style);
+}
+
 void os_init_sound(void)
 {
     audio_init();
@@ -31,6 +31,7 @@
 #define GREEN_PHOSPHOR      RGB(51, 255, 51)    // green phosphor
 #define AMBER_PHOSPHOR      RGB(255, 183, 0)    // amber phosphor
 #define FOREGROUND_COLOUR   RGB(255, 255, 255)  // default foreground colour
+#define BACKGROUND_COLOUR   RGB(0, 0, 0)        // default background colour
 #define DEFAULT_PHOSPHOR    WHITE_PHOSPHOR
 
 #define HISTORY_SIZE 20
@@ -42,6 +43,7 @@
 #define SETTINGS_PHOSPHOR_MASK  0x0C
 #define SETTINGS_PHOSPHOR_GREEN 0x04
 #define SETTINGS_PHOSPHOR_AMBER 0x08
+#define SETTINGS_PENDING        0x80000000 // Not saved, settings.ini not applied yet
 
 #define CONFIG_MAX_FILENAME_LEN (32)
 #define CONFIG_MAX_STORIES (256)
@@ -49,12 +51,19 @@
 
 #define MAX_DISPLAY_FILENAME_LEN (27)
 
+#define DEFAULT_AUTOSAVE_TURNS (10)
+
+#define UNDO_AUTO (0)        // Undo budget from the memory free once the story is loaded
+#define UNDO_OFF (-1)        // No undo
+#define MAX_UNDO_LEVELS (25) // As many as Frotz keeps on other systems
+
 typedef uint32_t settings_t;
 
 typedef struct
 {
     settings_t settings;
     char story_filename[CONFIG_MAX_FILENAME_LEN];
+    int undo_budget; // Kilobytes of memory for undo, UNDO_AUTO or UNDO_OFF
 } story_t;
 
 typedef struct
@@ -63,15 +72,174 @@ typedef struct
     size_t story_count;
     settings_t defaults;
     char default_save_path[FAT32_MAX_PATH_LEN];
+    int autosave_turns; // Turns between autosaves, 0 for none
 } config_t;
 
+// The stories shown in the selector; the stories matching the filter are
+// a contiguous range as the list is sorted ignoring case
+typedef struct
+{
+    int first;      // index of the first story matching the filter
+    int count;      // number of stories matching the filter
+    int page_start; // first story on the page (relative to first)
+    int selected;   // selected story (relative to first)
+} view_t;
+
 
 // No os_get_cursor() function in Frotz; we need access to the cursor position
 // for input handling.
 extern int cursor_row, cursor_col;
 extern uint8_t columns; // Number of columns in the display
+extern int undo_budget; // Undo budget of the story, in kilobytes, UNDO_AUTO or UNDO_OFF
 
 // Function prototypes
 void update_lcd_display(int top, int left, int bottom, int right);
 void draw_text(char *text, bool highlighted, int top, int offset, int page_start, int selected, int story_count);
 
+// A message on the last row, over the game, until it is hidden
+void show_message(const char *text);
+void hide_message(void);
+void show_battery_low(void);
+
+// The screen, cursor and text style, kept when the game is suspended
+size_t screen_state_size(void);
+void screen_state_get(zbyte *state);
+bool screen_state_set(const zbyte *state);
+
+// Battery level, sampled in the background
+void battery_init(void);
+void battery_poll(void);
+uint8_t battery_get_level(void);
+bool battery_is_low(void);
+bool battery_is_critical(void);
+
+// Story file access, the highlighted story is read ahead in the selector
+typedef bool (*idle_handler_t)(void);
+void set_idle_handler(idle_handler_t handler);
+size_t heap_free(void);
+void story_prefetch(const char *path);
+void story_prefetch_cancel(void);
+bool story_prefetch_step(void);
+FILE *story_open(const char *path);
+void story_loaded(long dynamic_size);
+int undo_levels(int version, long dynamic_size, size_t heap, int budget);
+
+// How a story will be loaded, worked out when it is highlighted in the selector
+typedef enum
+{
+    PLAN_FLASH,      // Installed in flash
+    PLAN_RAM,        // Read ahead into RAM
+    PLAN_PACKED_RAM, // Read ahead into RAM, decompressed as it is read
+    PLAN_SD,         // Read from the SD card
+    PLAN_TOO_LARGE,  // Does not fit in the heap
+} plan_mode_t;
+
+typedef struct
+{
+    plan_mode_t mode;
+    int undo_levels;
+    long story_size;
+    size_t heap_left; // Once the story is loaded, before undo
+} plan_t;
+
+void plan_story(const zbyte *header, long stored_size, bool packed, bool in_flash, size_t heap, int budget, plan_t *plan);
+bool story_plan(const char *path, int budget, plan_t *plan);
+
+// Heap use since the first prompt; growth that keeps rising is a leak
+typedef struct
+{
+    size_t in_use;  // Allocated now
+    long growth;    // Allocated now less at the first prompt
+    size_t peak;    // Highest the heap has reached
+    size_t free;    // Free now, including above the heap
+} heap_stats_t;
+
+void heap_sample(void);
+void heap_stats(heap_stats_t *stats);
+
+// Zero run-length coding, as in the CMem chunk of Quetzal saves; the data
+// may be XORed with a base, out may be NULL to find the encoded length
+typedef struct
+{
+    const zbyte *data;
+    size_t size;
+    size_t in;    // Next encoded byte
+    size_t out;   // Decoded bytes read so far
+    size_t zeros; // Zeros of the current run still to read
+} rle_reader_t;
+
+size_t rle_encode(const zbyte *data, const zbyte *base, size_t size, zbyte *out);
+void rle_reader_init(rle_reader_t *reader, const zbyte *data, size_t size);
+size_t rle_read(rle_reader_t *reader, zbyte *out, size_t n);
+void rle_xor(zbyte *data, const zbyte *base, size_t n);
+
+// IFF chunks, as in Quetzal saves; a chunk found includes its header and padding
+uint32_t iff_get32(const zbyte *p);
+void iff_put32(zbyte *p, uint32_t value);
+const zbyte *iff_find_chunk(const zbyte *data, size_t size, const char *id, size_t *length);
+bool iff_write_header(FILE *file, const char *id, size_t size);
+
+// Quick save slots, kept in RAM until the player quits. At the prompt, the
+// game is saved in RAM as a Quetzal save, or as an image with the screen and
+// the read going on. Restoring is done in os_read_line(), which then reads the
+// line into the buffers of the saved read, up to quick_read_max(). It returns
+// 1, 0 if the game was saved from another story or in another timed read, or
+// -1 if unreadable, with the game left as it was
+#define QUICK_READ_CHUNK (18) // The PCrd chunk of a save, with its header
+
+void quick_read_begin(int max);
+int quick_read_max(void);
+size_t quick_read_chunk(zbyte *chunk);
+char *quick_quetzal(size_t *size);
+char *quick_image(size_t *size);
+int quick_image_restore(const zbyte *data, size_t size);
+int quick_file_restore(FILE *file);
+bool quick_save(int slot);
+bool quick_restore(int slot);
+void quick_save_flush(void);
+
+// Autosave every few turns, to a log in the save directory of the story
+void autosave_init(int turns);
+void autosave_turn(void);
+bool autosave_resume(const char *dir);
+bool autosave_restore(void);
+
+// Suspend to the SD card, resumed when the PicoCalc is turned on again. The
+// story runs from its start until it first reads a line, where the game is
+// restored; it cannot be restored in a read of a single key, as the core then
+// stores the key through the restored program counter
+bool suspend_find(char *path, size_t size, story_t *story);
+bool suspend_resume(void);
+void suspend_game(bool critical);
+
+#ifdef PICOCALC_PROFILE
+// Instruction counts and cycles, by opcode, and calls by routine
+void profile_tick(void);
+bool profile_dump(void);
+#endif
+
+// Stories installed in flash, loaded without the SD card
+typedef enum
+{
+    FLASH_INSTALLED,
+    FLASH_ALREADY_INSTALLED,
+    FLASH_TOO_LARGE,
+    FLASH_READ_ERROR,
+    FLASH_NO_STORE,
+} flash_result_t;
+
+// Where the stories are installed: read in place, erased a sector and
+// programmed a page at a time
+typedef struct
+{
+    const zbyte *base;
+    uint32_t size;
+    void (*erase)(uint32_t offset, size_t size);
+    void (*program)(uint32_t offset, const zbyte *data, size_t size);
+} flash_store_t;
+
+const flash_store_t *flash_store_open(void);
+
+const zbyte *flash_find_story(const zbyte *header, long *length);
+flash_result_t flash_install_story(const char *path, void (*progress)(int percent));
+
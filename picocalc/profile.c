@@ -0,0 +1,353 @@
+//
+// profile.c - PicoCalc interface, instruction profiler
+//
+// Only built with the PICOCALC_PROFILE option. The core calls os_tick() after
+// each instruction, with the program counter at the next one: the cycles
+// since the last tick go to the instruction that just ran. Cycles are counted
+// with SysTick, leaving out the profiler's own work and any gap of more than
+// a few milliseconds (waiting for a key or the SD card). Calls are counted by
+// the byte address of the routine called, unpacked from the first operand of
+// the call before it runs. Pairs of opcodes run one after the other (bigrams)
+// are counted, to find those worth a fused handler in the core. The
+// profiler's own cycles are counted too. F6 at the prompt writes the counts
+// to profile.csv in the save directory.
+//
+
+#ifdef PICOCALC_PROFILE
+
+#include <stdio.h>
+
+#include "pico/stdlib.h"
+#include "hardware/structs/systick.h"
+
+#undef bool
+#include "picocalc_frotz.h"
+
+#define PROFILE_FILE "profile.csv"
+#define PROFILE_OPCODES (128)    // 2OP, 1OP, 0OP, VAR and EXT instructions
+#define PROFILE_ROUTINES (256)   // Routines counted apart, the rest together
+#define PROFILE_BIGRAMS (512)    // Pairs of opcodes counted apart, the rest together
+#define PROFILE_GAP_US (10000)   // Longer than this is not the interpreter running
+#define SYSTICK_MASK (0xFFFFFF)  // SysTick is a 24 bit counter, counting down
+
+#define OP_2OP (0)
+#define OP_1OP (32)
+#define OP_0OP (48)
+#define OP_VAR (64)
+#define OP_EXT (96)
+
+static const char *const opcode_names[PROFILE_OPCODES] = {
+	// 2OP
+	"2OP:0", "je", "jl", "jg", "dec_chk", "inc_chk", "jin", "test",
+	"or", "and", "test_attr", "set_attr", "clear_attr", "store", "insert_obj", "loadw",
+	"loadb", "get_prop", "get_prop_addr", "get_next_prop", "add", "sub", "mul", "div",
+	"mod", "call_2s", "call_2n", "set_colour", "throw", "2OP:29", "2OP:30", "2OP:31",
+	// 1OP
+	"jz", "get_sibling", "get_child", "get_parent", "get_prop_len", "inc", "dec", "print_addr",
+	"call_1s", "remove_obj", "print_obj", "ret", "jump", "print_paddr", "load", "call_1n/not",
+	// 0OP
+	"rtrue", "rfalse", "print", "print_ret", "nop", "save", "restore", "restart",
+	"ret_popped", "pop/catch", "quit", "new_line", "show_status", "verify", "extended", "piracy",
+	// VAR
+	"call_vs", "storew", "storeb", "put_prop", "read", "print_char", "print_num", "random",
+	"push", "pull", "split_window", "set_window", "call_vs2", "erase_window", "erase_line", "set_cursor",
+	"get_cursor", "set_text_style", "buffer_mode", "output_stream", "input_stream", "sound_effect", "read_char", "scan_table",
+	"not", "call_vn", "call_vn2", "tokenise", "encode_text", "copy_table", "print_table", "check_arg_count",
+	// EXT
+	"save_ext", "restore_ext", "log_shift", "art_shift", "set_font", "draw_picture", "picture_data", "erase_picture",
+	"set_margins", "save_undo", "restore_undo", "print_unicode", "check_unicode", "set_true_colour", "EXT:14", "EXT:15",
+	"move_window", "window_size", "window_style", "get_wind_prop", "scroll_window", "pop_stack", "read_mouse", "mouse_window",
+	"push_stack", "put_wind_prop", "print_form", "make_menu", "picture_table", "buffer_screen", "EXT:30", "EXT:31",
+};
+
+static struct
+{
+	bool started;
+	uint32_t time;   // When the last tick ended, in microseconds
+	uint32_t cycles; // SysTick when the last tick ended
+	int opcode;      // The instruction about to run
+	uint32_t counts[PROFILE_OPCODES];
+	uint64_t totals[PROFILE_OPCODES];
+	uint32_t ticks;    // Of the profiler, after the first
+	uint64_t overhead; // Cycles spent in them
+	struct
+	{
+		uint32_t address; // Of the routine header, 0 for none
+		uint32_t calls;
+	} routines[PROFILE_ROUTINES];
+	uint32_t other_calls;
+	struct
+	{
+		uint16_t pair; // First opcode * PROFILE_OPCODES + second, plus 1; 0 for none
+		uint32_t count;
+	} bigrams[PROFILE_BIGRAMS];
+	uint32_t other_bigrams;
+} profile = {0};
+
+static int profile_opcode(const zbyte *p)
+{
+	zbyte b = p[0];
+
+	if (b < 0x80)
+	{
+		return OP_2OP + (b & 0x1F);
+	}
+	if (b < 0xB0)
+	{
+		return OP_1OP + (b & 0x0F);
+	}
+	if (b == 0xBE && z_header.version >= V5)
+	{
+		return OP_EXT + (p[1] & 0x1F);
+	}
+	if (b < 0xC0)
+	{
+		return OP_0OP + (b & 0x0F);
+	}
+	if (b < 0xE0)
+	{
+		return OP_2OP + (b & 0x1F);
+	}
+	return OP_VAR + (b & 0x1F);
+}
+
+static bool profile_is_call(int opcode)
+{
+	switch (opcode)
+	{
+	case OP_VAR + 0:
+		return true;
+	case OP_2OP + 25:
+	case OP_1OP + 8:
+	case OP_VAR + 12:
+		return z_header.version >= V4;
+	case OP_2OP + 26:
+	case OP_1OP + 15:
+	case OP_VAR + 25:
+	case OP_VAR + 26:
+		return z_header.version >= V5;
+	default:
+		return false;
+	}
+}
+
+// The value of a variable, as the instruction about to run will read it
+static zword profile_variable(zbyte variable)
+{
+	if (variable == 0)
+	{
+		return *sp; // The top of the stack
+	}
+	if (variable < 16)
+	{
+		return *(fp - variable);
+	}
+	const zbyte *global = zmp + z_header.globals + 2 * (variable - 16);
+	return (global[0] << 8) | global[1];
+}
+
+// The first operand of the instruction at p, the routine of a call
+static zword profile_first_operand(const zbyte *p)
+{
+	zbyte b = p[0];
+	int type;
+
+	if (b < 0x80)
+	{
+		// Long form, a small constant or a variable
+		return b & 0x40 ? profile_variable(p[1]) : p[1];
+	}
+	if (b < 0xC0)
+	{
+		// Short form, the type in the opcode
+		type = (b >> 4) & 3;
+		p += 1;
+	}
+	else
+	{
+		// Variable form, the types after the opcode; call_vs2 and call_vn2
+		// have two bytes of them
+		type = p[1] >> 6;
+		p += b == 0xEC || b == 0xFA ? 3 : 2;
+	}
+
+	switch (type)
+	{
+	case 0:
+		return (p[0] << 8) | p[1];
+	case 1:
+		return p[0];
+	case 2:
+		return profile_variable(p[0]);
+	default:
+		return 0;
+	}
+}
+
+static long profile_unpack(zword packed)
+{
+	if (z_header.version <= V3)
+	{
+		return 2L * packed;
+	}
+	if (z_header.version <= V5)
+	{
+		return 4L * packed;
+	}
+	if (z_header.version <= V7)
+	{
+		return 4L * packed + 8L * z_header.functions_offset;
+	}
+	return 8L * packed;
+}
+
+// Count a call to the routine whose header is at address
+static void profile_routine(long address)
+{
+	uint32_t index = ((uint32_t)address * 2654435761u) >> 24;
+	for (int i = 0; i < PROFILE_ROUTINES; i++)
+	{
+		uint32_t slot = (index + i) % PROFILE_ROUTINES;
+		if (profile.routines[slot].address == (uint32_t)address || profile.routines[slot].address == 0)
+		{
+			profile.routines[slot].address = address;
+			profile.routines[slot].calls++;
+			return;
+		}
+	}
+	profile.other_calls++;
+}
+
+// Count an instruction followed by another
+static void profile_bigram(int first, int second)
+{
+	uint16_t pair = first * PROFILE_OPCODES + second + 1;
+	uint32_t index = ((uint32_t)pair * 2654435761u) >> 23;
+	for (int i = 0; i < PROFILE_BIGRAMS; i++)
+	{
+		uint32_t slot = (index + i) % PROFILE_BIGRAMS;
+		if (profile.bigrams[slot].pair == pair || profile.bigrams[slot].pair == 0)
+		{
+			profile.bigrams[slot].pair = pair;
+			profile.bigrams[slot].count++;
+			return;
+		}
+	}
+	profile.other_bigrams++;
+}
+
+void profile_tick(void)
+{
+	uint32_t cycles = systick_hw->cvr;
+	uint32_t time = time_us_32();
+	bool counted = profile.started;
+
+	if (!profile.started)
+	{
+		systick_hw->rvr = SYSTICK_MASK;
+		systick_hw->csr = 0x5; // Enabled, counting processor cycles
+		profile.started = true;
+	}
+	else
+	{
+		profile.counts[profile.opcode]++;
+		if (time - profile.time < PROFILE_GAP_US)
+		{
+			profile.totals[profile.opcode] += (profile.cycles - cycles) & SYSTICK_MASK;
+		}
+	}
+
+	int opcode = profile_opcode(pcp);
+	if (counted)
+	{
+		profile_bigram(profile.opcode, opcode);
+	}
+
+	// A call to routine 0 does not call anything, it stores false
+	profile.opcode = opcode;
+	if (profile_is_call(profile.opcode))
+	{
+		zword packed = profile_first_operand(pcp);
+		if (packed != 0)
+		{
+			profile_routine(profile_unpack(packed));
+		}
+	}
+
+	profile.time = time_us_32();
+	profile.cycles = systick_hw->cvr;
+	if (counted)
+	{
+		profile.ticks++;
+		profile.overhead += (cycles - profile.cycles) & SYSTICK_MASK;
+	}
+}
+
+// The printf of newlib nano has no 64 bit numbers
+static void profile_print_u64(FILE *file, uint64_t n)
+{
+	char digits[21];
+	int i = sizeof(digits) - 1;
+
+	digits[i] = '\0';
+	do
+	{
+		digits[--i] = '0' + n % 10;
+		n /= 10;
+	} while (n > 0);
+	fputs(&digits[i], file);
+}
+
+bool profile_dump(void)
+{
+	char path[FAT32_MAX_PATH_LEN];
+
+	snprintf(path, sizeof(path), "%s/%s", f_setup.restricted_path, PROFILE_FILE);
+	FILE *file = fopen(path, "w");
+	if (file == NULL)
+	{
+		return false;
+	}
+
+	fprintf(file, "kind,name,count,cycles\n");
+	for (int i = 0; i < PROFILE_OPCODES; i++)
+	{
+		if (profile.counts[i] > 0)
+		{
+			fprintf(file, "opcode,%s,%lu,", opcode_names[i], (unsigned long)profile.counts[i]);
+			profile_print_u64(file, profile.totals[i]);
+			fputc('\n', file);
+		}
+	}
+	for (int i = 0; i < PROFILE_ROUTINES; i++)
+	{
+		if (profile.routines[i].address != 0)
+		{
+			fprintf(file, "routine,0x%05lx,%lu,\n", (unsigned long)profile.routines[i].address,
+					(unsigned long)profile.routines[i].calls);
+		}
+	}
+	if (profile.other_calls > 0)
+	{
+		fprintf(file, "routine,other,%lu,\n", (unsigned long)profile.other_calls);
+	}
+	for (int i = 0; i < PROFILE_BIGRAMS; i++)
+	{
+		if (profile.bigrams[i].pair != 0)
+		{
+			int pair = profile.bigrams[i].pair - 1;
+			fprintf(file, "bigram,%s %s,%lu,\n", opcode_names[pair / PROFILE_OPCODES],
+					opcode_names[pair % PROFILE_OPCODES], (unsigned long)profile.bigrams[i].count);
+		}
+	}
+	if (profile.other_bigrams > 0)
+	{
+		fprintf(file, "bigram,other,%lu,\n", (unsigned long)profile.other_bigrams);
+	}
+	fprintf(file, "profiler,profile_tick,%lu,", (unsigned long)profile.ticks);
+	profile_print_u64(file, profile.overhead);
+	fputc('\n', file);
+	return fclose(file) == 0;
+}
+
+#endif
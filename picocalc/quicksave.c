@@ -0,0 +1,377 @@
+//
+// quicksave.c - PicoCalc interface, quick save slots
+//
+// A quick save is a Quetzal save kept in RAM, with the screen in a PCsc chunk.
+// Its CMem chunk holds dynamic memory XORed with the story and run-length
+// encoded, and the story is read from the snapshot taken at load, so saving
+// and restoring do not touch the SD card. The slots are written to the save
+// directory when the player quits, to be restored in the next game.
+//
+// The game is saved and restored at the prompt, in the middle of reading a
+// line, not by SAVE and RESTORE: the program counter is past the operands of
+// the read instruction. The images cannot be loaded with RESTORE, which would
+// go on to store or branch past them, so the files have their own extension.
+//
+// The read going on when restoring may not be the one saved: its operands are
+// kept in a PCrd chunk (the text and parse buffers, the timeout and its
+// routine, then the longest line), and the line read is put in the buffers of
+// the save. The core keeps the timeout and routine of the read going on, so a
+// game saved in another timed read is not restored.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#undef bool
+#include "picocalc_frotz.h"
+#include "quetzal.h"
+
+#define QUICK_SAVE_SLOTS (2)
+#define QUICK_SAVE_NAME "quick%d.qsl" // In the save directory of the story
+#define QUICK_READ_SIZE (QUICK_READ_CHUNK - 8)
+
+static struct
+{
+	char *data;
+	size_t size;
+	bool dirty; // Not written to the SD card yet
+} slots[QUICK_SAVE_SLOTS] = {0};
+
+static int read_max = 0; // Longest line of the read going on, from its save once restored
+
+static void quick_save_path(int slot, char *path, size_t size)
+{
+	snprintf(path, size, "%s/" QUICK_SAVE_NAME, f_setup.restricted_path, slot + 1);
+}
+
+// Read a slot written by an earlier game
+static bool quick_save_load(int slot)
+{
+	char path[FAT32_MAX_PATH_LEN];
+
+	quick_save_path(slot, path, sizeof(path));
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+	{
+		return false;
+	}
+
+	long size = -1;
+	char *data = NULL;
+	if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) > 0 && fseek(file, 0, SEEK_SET) == 0 &&
+		(data = malloc(size)) != NULL && fread(data, 1, size, file) != (size_t)size)
+	{
+		free(data);
+		data = NULL;
+	}
+	fclose(file);
+
+	if (data == NULL)
+	{
+		return false;
+	}
+	slots[slot].data = data;
+	slots[slot].size = size;
+	slots[slot].dirty = false;
+	return true;
+}
+
+// Saves are written to RAM through a stream of this buffer. The save ends by
+// going back to write the length of the FORM; a stream from open_memstream()
+// would then end there, as its size is taken at the position.
+typedef struct
+{
+	char *data;
+	size_t size;
+	size_t capacity;
+	size_t pos;
+} quick_buffer_t;
+
+static ssize_t quick_buffer_write(void *cookie, const char *buf, size_t size)
+{
+	quick_buffer_t *b = (quick_buffer_t *)cookie;
+
+	if (b->pos + size > b->capacity)
+	{
+		size_t capacity = MAX(b->pos + size, b->capacity + b->capacity / 2);
+		char *data = realloc(b->data, capacity);
+		if (data == NULL)
+		{
+			return -1;
+		}
+		b->data = data;
+		b->capacity = capacity;
+	}
+	memcpy(b->data + b->pos, buf, size);
+	b->pos += size;
+	b->size = MAX(b->size, b->pos);
+	return size;
+}
+
+static int quick_buffer_seek(void *cookie, off_t *offset, int whence)
+{
+	quick_buffer_t *b = (quick_buffer_t *)cookie;
+	long pos = *offset;
+
+	if (whence == SEEK_CUR)
+	{
+		pos += b->pos;
+	}
+	else if (whence == SEEK_END)
+	{
+		pos += b->size;
+	}
+	if (pos < 0 || (size_t)pos > b->size)
+	{
+		return -1;
+	}
+
+	b->pos = pos;
+	*offset = pos;
+	return 0;
+}
+
+char *quick_quetzal(size_t *size)
+{
+	cookie_io_functions_t io = {NULL, quick_buffer_write, quick_buffer_seek, NULL};
+	quick_buffer_t buffer = {0};
+
+	*size = 0;
+	FILE *file = fopencookie(&buffer, "wb", io);
+	if (file == NULL)
+	{
+		return NULL;
+	}
+	zword success = save_quetzal(file, story_fp);
+	success = fclose(file) == 0 && success;
+
+	if (!success || buffer.size < 12)
+	{
+		free(buffer.data);
+		return NULL;
+	}
+	*size = buffer.size;
+	return buffer.data;
+}
+
+void quick_read_begin(int max)
+{
+	read_max = max;
+}
+
+int quick_read_max(void)
+{
+	return read_max;
+}
+
+size_t quick_read_chunk(zbyte *chunk)
+{
+	memcpy(chunk, "PCrd", 4);
+	iff_put32(chunk + 4, QUICK_READ_SIZE);
+	for (int i = 0; i < 4; i++)
+	{
+		chunk[8 + 2 * i] = zargs[i] >> 8;
+		chunk[9 + 2 * i] = zargs[i] & 0xFF;
+	}
+	chunk[16] = read_max;
+	chunk[17] = 0;
+	return 8 + QUICK_READ_SIZE;
+}
+
+char *quick_image(size_t *size)
+{
+	size_t quetzal_size;
+	size_t screen_size = screen_state_size();
+	size_t padded_size = screen_size + (screen_size & 1);
+
+	char *quetzal = quick_quetzal(&quetzal_size);
+	char *data = quetzal != NULL ? realloc(quetzal, quetzal_size + 8 + padded_size + 8 + QUICK_READ_SIZE) : NULL;
+	if (data == NULL)
+	{
+		free(quetzal);
+		return NULL;
+	}
+
+	// The screen and the read go inside the FORM, after the chunks of the save
+	memcpy(data + quetzal_size, "PCsc", 4);
+	iff_put32((zbyte *)data + quetzal_size + 4, screen_size);
+	memset(data + quetzal_size + 8, 0, padded_size);
+	screen_state_get((zbyte *)data + quetzal_size + 8);
+	*size = quetzal_size + 8 + padded_size;
+	*size += quick_read_chunk((zbyte *)data + *size);
+	iff_put32((zbyte *)data + 4, *size - 8);
+	return data;
+}
+
+// Restore a Quetzal save, checked as Frotz's z_restore() does
+static short quick_quetzal_restore(FILE *file)
+{
+	return (short)restore_quetzal(file, story_fp);
+}
+
+// Restore a Quetzal save from RAM
+static short quick_quetzal_restore_data(const zbyte *data, size_t size)
+{
+	FILE *file = fmemopen((void *)data, size, "rb");
+	if (file == NULL)
+	{
+		return 0;
+	}
+	short success = quick_quetzal_restore(file);
+	fclose(file);
+	return success;
+}
+
+// Find the PCrd chunk of a save, false if it has none
+static bool quick_read_find(FILE *file, zbyte *read)
+{
+	zbyte header[12];
+
+	if (fseek(file, 0, SEEK_SET) != 0 || fread(header, 1, sizeof(header), file) != sizeof(header) ||
+		memcmp(header, "FORM", 4) != 0)
+	{
+		return false;
+	}
+	long end = 8 + (long)iff_get32(header + 4);
+	for (long pos = 12; pos + 8 <= end; pos += 8 + iff_get32(header + 4) + (iff_get32(header + 4) & 1))
+	{
+		if (fseek(file, pos, SEEK_SET) != 0 || fread(header, 1, 8, file) != 8)
+		{
+			return false;
+		}
+		if (memcmp(header, "PCrd", 4) == 0)
+		{
+			return iff_get32(header + 4) >= QUICK_READ_SIZE && fread(read, 1, QUICK_READ_SIZE, file) == QUICK_READ_SIZE;
+		}
+	}
+	return false;
+}
+
+int quick_file_restore(FILE *file)
+{
+	// A timed read goes on with the timeout and routine it has now
+	zbyte read[QUICK_READ_SIZE];
+	bool has_read = quick_read_find(file, read);
+	if (has_read)
+	{
+		zword timeout = (read[4] << 8) | read[5];
+		zword routine = (read[6] << 8) | read[7];
+		if (timeout != zargs[2] || (timeout != 0 && routine != zargs[3]))
+		{
+			return 0;
+		}
+	}
+	if (fseek(file, 0, SEEK_SET) != 0)
+	{
+		return -1;
+	}
+
+	// Restoring fails part way if the save is damaged, with dynamic memory
+	// or the stack overwritten; the game is then put back as it is now
+	size_t backup_size;
+	char *backup = quick_quetzal(&backup_size);
+
+	short success = quick_quetzal_restore(file);
+	if (success < 0 && (backup == NULL || quick_quetzal_restore_data((zbyte *)backup, backup_size) <= 0))
+	{
+		os_fatal("Error reading saved game");
+	}
+	free(backup);
+	if (success == 0)
+	{
+		return 0; // Saved from another story, nothing changed
+	}
+
+	// The line is read into the buffers of the save, as long as it allows
+	if (success > 0 && has_read)
+	{
+		zargs[0] = (read[0] << 8) | read[1];
+		zargs[1] = (read[2] << 8) | read[3];
+		read_max = read[8] > 0 ? read[8] : read_max;
+	}
+
+	// As after RESTORE
+	if (z_header.version == V3)
+	{
+		split_window(0);
+	}
+	restart_header();
+	return success > 0 ? 1 : -1;
+}
+
+int quick_image_restore(const zbyte *data, size_t size)
+{
+	size_t chunk_size;
+
+	FILE *file = fmemopen((void *)data, size, "rb");
+	if (file == NULL)
+	{
+		return 0;
+	}
+	int success = quick_file_restore(file);
+	fclose(file);
+	if (success <= 0)
+	{
+		return success;
+	}
+
+	// Then the screen as it was saved
+	const zbyte *chunk = size > 12 ? iff_find_chunk(data + 12, size - 12, "PCsc", &chunk_size) : NULL;
+	if (chunk != NULL && chunk_size >= 8 + screen_state_size())
+	{
+		screen_state_set(chunk + 8);
+	}
+	return 1;
+}
+
+bool quick_save(int slot)
+{
+	size_t size;
+
+	char *data = quick_image(&size);
+	if (data == NULL)
+	{
+		return false;
+	}
+
+	free(slots[slot].data);
+	slots[slot].data = data;
+	slots[slot].size = size;
+	slots[slot].dirty = true;
+	return true;
+}
+
+bool quick_restore(int slot)
+{
+	if (slots[slot].data == NULL && !quick_save_load(slot))
+	{
+		return false;
+	}
+	return quick_image_restore((const zbyte *)slots[slot].data, slots[slot].size) > 0;
+}
+
+void quick_save_flush(void)
+{
+	char path[FAT32_MAX_PATH_LEN];
+
+	for (int slot = 0; slot < QUICK_SAVE_SLOTS; slot++)
+	{
+		if (!slots[slot].dirty)
+		{
+			continue;
+		}
+
+		quick_save_path(slot, path, sizeof(path));
+		FILE *file = fopen(path, "wb");
+		if (file != NULL)
+		{
+			if (fwrite(slots[slot].data, 1, slots[slot].size, file) == slots[slot].size)
+			{
+				slots[slot].dirty = false;
+			}
+			fclose(file);
+		}
+	}
+}
@@ -0,0 +1,160 @@
+//
+// rle.c - PicoCalc interface, zero run-length coding
+//
+// The coding of the CMem chunk of a Quetzal save: a byte other than zero is
+// kept, and a zero is followed by the number of zeros after it (up to 255).
+// Memory is mostly zeros, or mostly unchanged when XORed with the story.
+//
+// Runs of zeros are found a word at a time when the data and the base are
+// aligned alike, as they are when both come from malloc().
+//
+
+#include <stdint.h>
+#include <string.h>
+
+#undef bool
+#include "picocalc_frotz.h"
+
+// A word of memory that may hold bytes of anything (for GCC's aliasing rules)
+typedef uint32_t __attribute__((__may_alias__)) rle_word_t;
+
+#define RLE_BYTE(data, base, i) ((base) != NULL ? (data)[i] ^ (base)[i] : (data)[i])
+
+// Count the zeros from i, stopping at end
+static size_t rle_zeros(const zbyte *data, const zbyte *base, size_t i, size_t end)
+{
+	size_t start = i;
+
+	// Up to the first word boundary
+	while (i < end && ((uintptr_t)(data + i) & 3) != 0)
+	{
+		if (RLE_BYTE(data, base, i) != 0)
+		{
+			return i - start;
+		}
+		i++;
+	}
+
+	if (base == NULL)
+	{
+		while (i + 4 <= end && *(const rle_word_t *)(data + i) == 0)
+		{
+			i += 4;
+		}
+	}
+	else if (((uintptr_t)base & 3) == ((uintptr_t)data & 3))
+	{
+		while (i + 4 <= end && *(const rle_word_t *)(data + i) == *(const rle_word_t *)(base + i))
+		{
+			i += 4;
+		}
+	}
+
+	// The rest, or all of it when the base is not aligned like the data
+	while (i < end && RLE_BYTE(data, base, i) == 0)
+	{
+		i++;
+	}
+	return i - start;
+}
+
+size_t rle_encode(const zbyte *data, const zbyte *base, size_t size, zbyte *out)
+{
+	size_t length = 0;
+	size_t i = 0;
+
+	while (i < size)
+	{
+		zbyte b = RLE_BYTE(data, base, i);
+		i++;
+		if (b != 0)
+		{
+			if (out != NULL)
+			{
+				out[length] = b;
+			}
+			length++;
+			continue;
+		}
+
+		// Count the zeros that follow this one
+		size_t run = rle_zeros(data, base, i, MIN(size, i + 255));
+		i += run;
+		if (out != NULL)
+		{
+			out[length] = 0;
+			out[length + 1] = run;
+		}
+		length += 2;
+	}
+	return length;
+}
+
+void rle_reader_init(rle_reader_t *reader, const zbyte *data, size_t size)
+{
+	reader->data = data;
+	reader->size = size;
+	reader->in = 0;
+	reader->out = 0;
+	reader->zeros = 0;
+}
+
+size_t rle_read(rle_reader_t *reader, zbyte *out, size_t n)
+{
+	size_t done = 0;
+
+	while (done < n)
+	{
+		if (reader->zeros > 0)
+		{
+			size_t run = MIN(reader->zeros, n - done);
+			if (out != NULL)
+			{
+				memset(out + done, 0, run);
+			}
+			reader->zeros -= run;
+			done += run;
+			continue;
+		}
+		if (reader->in >= reader->size)
+		{
+			break; // End of the data
+		}
+
+		zbyte b = reader->data[reader->in++];
+		if (b == 0)
+		{
+			// A run of zeros, this one and the count after it
+			reader->zeros = 1 + (reader->in < reader->size ? reader->data[reader->in++] : 0);
+			continue;
+		}
+		if (out != NULL)
+		{
+			out[done] = b;
+		}
+		done++;
+	}
+	reader->out += done;
+	return done;
+}
+
+void rle_xor(zbyte *data, const zbyte *base, size_t n)
+{
+	size_t i = 0;
+
+	if (((uintptr_t)data & 3) == ((uintptr_t)base & 3))
+	{
+		for (; i < n && ((uintptr_t)(data + i) & 3) != 0; i++)
+		{
+			data[i] ^= base[i];
+		}
+		for (; i + 4 <= n; i += 4)
+		{
+			*(rle_word_t *)(data + i) ^= *(const rle_word_t *)(base + i);
+		}
+	}
+	for (; i < n; i++)
+	{
+		data[i] ^= base[i];
+	}
+}
@@ -0,0 +1,747 @@
+//
+// story.c - PicoCalc interface, story file access
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <unistd.h>
+#include "pico/stdlib.h"
+
+#undef bool
+#include "picocalc_frotz.h"
+#include "blorb.h"
+
+#define PREFETCH_CHUNK (4096)        // Bytes read from the SD card per idle poll
+#define PREFETCH_DELAY_MS (250)      // Time the selection must rest before reading ahead
+#define PREFETCH_RESERVE (32 * 1024) // Heap to leave once the interpreter has its copy
+
+#define UNDO_RESERVE (16 * 1024)     // Heap left for saves and the port after undo
+#define UNDO_CHANGED (32)            // Part of dynamic memory changed in a turn (1/n)
+#define UNDO_LEVEL_OVERHEAD (512)    // Stack and bookkeeping of each undo level
+
+#define PACKED_MAGIC "ZLZ1"  // Block-compressed story, see tools/zlz.py
+#define PACKED_HEADER (16)   // Magic, story length, block size and block count
+
+extern char __HeapLimit; // End of the heap, from the linker script
+
+// A story read ahead into RAM while the selector is shown
+static struct
+{
+	char path[FAT32_MAX_PATH_LEN];
+	FILE *file;
+	zbyte *buffer;
+	long base; // Start of the story in the file, as in story_stream_t
+	long size; // Of the story as stored, without the rest of a Blorb
+	long loaded;
+	bool failed;                // Too large or unreadable, do not try again
+	absolute_time_t start_time; // When to start reading
+} prefetch = {0};
+
+// The story file as seen by the interpreter; the story may be installed in
+// flash, otherwise its start may be resident in RAM and the rest is read from
+// the SD card when needed. A packed story is decompressed a block at a time.
+// In a Blorb file, only the story chunk is seen.
+typedef struct
+{
+	char path[FAT32_MAX_PATH_LEN];
+	FILE *file;
+	const zbyte *flash;
+	zbyte *resident; // The start of the story as stored, from base
+	long resident_size;
+	long base; // Start of the story in the file
+	long size;
+	long pos;
+	uint32_t *blocks;  // Offset of each packed block in the file, and the end
+	long block_size;   // Bytes of story in each block
+	long block_count;
+	long block_index;  // The block in block, -1 if none
+	zbyte *block;      // The last block decompressed
+	zbyte *packed;     // A packed block, when read from the SD card
+	zbyte *pristine;   // Dynamic memory as loaded, zero run-length encoded
+	long dynamic_size;
+	rle_reader_t reader; // Reading pristine
+} story_stream_t;
+
+static story_stream_t stream = {0};
+
+static struct
+{
+	bool sampled;
+	size_t first_in_use; // At the first prompt
+} heap = {0};
+
+size_t heap_free(void)
+{
+	struct mallinfo info = mallinfo();
+	return info.fordblks + (&__HeapLimit - (char *)sbrk(0));
+}
+
+void heap_sample(void)
+{
+	if (!heap.sampled)
+	{
+		heap.sampled = true;
+		heap.first_in_use = mallinfo().uordblks;
+	}
+}
+
+void heap_stats(heap_stats_t *stats)
+{
+	struct mallinfo info = mallinfo();
+
+	// The heap only grows, what newlib took from the system is the peak
+	stats->in_use = info.uordblks;
+	stats->growth = heap.sampled ? (long)info.uordblks - (long)heap.first_in_use : 0;
+	stats->peak = info.arena;
+	stats->free = heap_free();
+}
+
+// Undo levels that fit in a budget (in kilobytes), or half of the heap left.
+// Frotz's init_undo() takes two and a half times dynamic memory (the previous
+// state and room for a diff) for every story, even with no undo levels; then
+// each level holds the changes made in a turn (a small part of dynamic
+// memory) and the stack. When memory runs short it drops the oldest level
+// before failing the next one.
+int undo_levels(int version, long dynamic_size, size_t heap, int budget)
+{
+	size_t fixed = dynamic_size * 5 / 2 + 2;
+	size_t level = dynamic_size / UNDO_CHANGED + UNDO_LEVEL_OVERHEAD;
+
+	if (heap < fixed + UNDO_RESERVE)
+	{
+		return 0;
+	}
+	heap -= fixed;
+
+	// Only games from version 5 can undo
+	if (version < V5 || budget == UNDO_OFF)
+	{
+		return 0;
+	}
+
+	size_t bytes = budget == UNDO_AUTO ? (heap - UNDO_RESERVE) / 2 : (size_t)budget * 1024;
+	bytes = MIN(bytes, heap - UNDO_RESERVE);
+	return MIN(bytes / level, MAX_UNDO_LEVELS);
+}
+
+// How a story will be loaded and how many undo levels it will have, from its
+// header, its file and the heap the game will have; nothing else is looked at,
+// so the plan can be made for any story and any board
+void plan_story(const zbyte *header, long stored_size, bool packed, bool in_flash, size_t heap, int budget, plan_t *plan)
+{
+	int version = header[H_VERSION];
+	long scale = version <= V3 ? 2 : version <= V5 ? 4 : 8;
+	long length = ((header[H_FILE_SIZE] << 8) | header[H_FILE_SIZE + 1]) * scale;
+	long dynamic_size = (header[H_DYNAMIC_SIZE] << 8) | header[H_DYNAMIC_SIZE + 1];
+
+	// Early stories leave the length out of the header
+	plan->story_size = length > 0 ? length : stored_size;
+
+	// The interpreter's copy of the story and the snapshot of dynamic memory
+	size_t needed = plan->story_size + dynamic_size;
+	if (heap < needed + PREFETCH_RESERVE)
+	{
+		plan->mode = PLAN_TOO_LARGE;
+		plan->undo_levels = 0;
+		plan->heap_left = heap > needed ? heap - needed : 0;
+		return;
+	}
+	plan->heap_left = heap - needed;
+
+	// As decided when reading ahead, then when the story is opened
+	if (in_flash)
+	{
+		plan->mode = PLAN_FLASH;
+	}
+	else if (heap >= 2 * (size_t)stored_size + PREFETCH_RESERVE)
+	{
+		plan->mode = packed ? PLAN_PACKED_RAM : PLAN_RAM;
+	}
+	else
+	{
+		plan->mode = PLAN_SD;
+	}
+	plan->undo_levels = undo_levels(version, dynamic_size, plan->heap_left, budget);
+}
+
+static bool story_header(const char *path, zbyte *header, long *base, long *stored_size, bool *packed);
+
+// Give up reading ahead this story, until another one is selected
+static void story_prefetch_fail(void)
+{
+	if (prefetch.file != NULL)
+	{
+		fclose(prefetch.file);
+		prefetch.file = NULL;
+	}
+	free(prefetch.buffer);
+	prefetch.buffer = NULL;
+	prefetch.failed = true;
+}
+
+void story_prefetch(const char *path)
+{
+	if (strcmp(path, prefetch.path) == 0)
+	{
+		return; // Already reading this story
+	}
+
+	story_prefetch_cancel();
+	strncpy(prefetch.path, path, sizeof(prefetch.path) - 1);
+	prefetch.start_time = make_timeout_time_ms(PREFETCH_DELAY_MS);
+}
+
+void story_prefetch_cancel(void)
+{
+	if (prefetch.file != NULL)
+	{
+		fclose(prefetch.file);
+	}
+	free(prefetch.buffer);
+	memset(&prefetch, 0, sizeof(prefetch));
+}
+
+bool story_prefetch_step(void)
+{
+	if (prefetch.path[0] == '\0' || prefetch.failed ||
+		(prefetch.buffer != NULL && prefetch.loaded == prefetch.size))
+	{
+		return false; // Nothing to do
+	}
+
+	if (prefetch.file == NULL)
+	{
+		if (absolute_time_diff_us(get_absolute_time(), prefetch.start_time) > 0)
+		{
+			return false; // The selection may still be moving
+		}
+
+		// A story installed in flash is not read from the SD card at all
+		zbyte header[64];
+		long size;
+		bool packed;
+		if (!story_header(prefetch.path, header, &prefetch.base, &prefetch.size, &packed) ||
+			flash_find_story(header, &size) != NULL)
+		{
+			story_prefetch_fail();
+			return false;
+		}
+
+		// Only the story, the pictures and sounds of a Blorb are never read
+		prefetch.file = fopen(prefetch.path, "rb");
+		if (prefetch.file == NULL || fseek(prefetch.file, prefetch.base, SEEK_SET) != 0)
+		{
+			story_prefetch_fail();
+			return false;
+		}
+
+		// The interpreter makes its own copy, so both must fit
+		if (prefetch.size <= 0 || heap_free() < 2 * (size_t)prefetch.size + PREFETCH_RESERVE ||
+			(prefetch.buffer = malloc(prefetch.size)) == NULL)
+		{
+			story_prefetch_fail();
+			return false;
+		}
+	}
+
+	long n = MIN(prefetch.size - prefetch.loaded, PREFETCH_CHUNK);
+	if (fread(prefetch.buffer + prefetch.loaded, 1, n, prefetch.file) != (size_t)n)
+	{
+		story_prefetch_fail();
+		return false;
+	}
+	prefetch.loaded += n;
+
+	if (prefetch.loaded == prefetch.size)
+	{
+		fclose(prefetch.file);
+		prefetch.file = NULL;
+		return false;
+	}
+	return true;
+}
+
+static uint32_t get_le32(const zbyte *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Read the file from the SD card
+static long story_read_file(story_stream_t *s, long pos, zbyte *buf, long n)
+{
+	if (s->file == NULL && (s->file = fopen(s->path, "rb")) == NULL)
+	{
+		return -1;
+	}
+	if (fseek(s->file, pos, SEEK_SET) != 0)
+	{
+		return -1;
+	}
+	return fread(buf, 1, n, s->file);
+}
+
+// Decompress an LZ4 block, returning the length of the result or -1 if the
+// block is damaged
+static long lz4_decompress(const zbyte *src, long src_size, zbyte *dst, long dst_size)
+{
+	const zbyte *end = src + src_size;
+	zbyte *out = dst;
+
+	while (src < end)
+	{
+		unsigned token = *src++;
+
+		long len = token >> 4;
+		if (len == 15)
+		{
+			unsigned b;
+			do
+			{
+				if (src >= end)
+				{
+					return -1;
+				}
+				b = *src++;
+				len += b;
+			} while (b == 255);
+		}
+		if (len > end - src || len > dst + dst_size - out)
+		{
+			return -1;
+		}
+		memcpy(out, src, len);
+		out += len;
+		src += len;
+		if (src == end)
+		{
+			break; // The last sequence has no match
+		}
+
+		if (end - src < 2)
+		{
+			return -1;
+		}
+		long offset = src[0] | (src[1] << 8);
+		src += 2;
+		if (offset == 0 || offset > out - dst)
+		{
+			return -1;
+		}
+
+		len = token & 0x0F;
+		if (len == 15)
+		{
+			unsigned b;
+			do
+			{
+				if (src >= end)
+				{
+					return -1;
+				}
+				b = *src++;
+				len += b;
+			} while (b == 255);
+		}
+		len += 4;
+		if (len > dst + dst_size - out)
+		{
+			return -1;
+		}
+
+		// The match may overlap the bytes being written
+		const zbyte *match = out - offset;
+		while (len-- > 0)
+		{
+			*out++ = *match++;
+		}
+	}
+	return out - dst;
+}
+
+// Read the story as stored, before it is decompressed, from RAM if resident
+// or from the SD card
+static long story_read_stored(story_stream_t *s, long pos, zbyte *buf, long n)
+{
+	long done = 0;
+
+	if (pos < s->resident_size)
+	{
+		done = MIN(n, s->resident_size - pos);
+		memcpy(buf, s->resident + pos, done);
+	}
+	if (done < n)
+	{
+		long read = story_read_file(s, s->base + pos + done, buf + done, n - done);
+		if (read < 0)
+		{
+			return -1;
+		}
+		done += read;
+	}
+	return done;
+}
+
+// Decompress a block of a packed story into the block buffer
+static bool story_unpack_block(story_stream_t *s, long index)
+{
+	long stored = s->blocks[index + 1] - s->blocks[index];
+	long length = MIN(s->block_size, s->size - index * s->block_size);
+
+	if (s->block == NULL && (s->block = malloc(s->block_size)) == NULL)
+	{
+		return false;
+	}
+	s->block_index = -1;
+
+	if (stored == length)
+	{
+		// Stored as is, it did not compress
+		if (story_read_stored(s, s->blocks[index], s->block, length) != length)
+		{
+			return false;
+		}
+		s->block_index = index;
+		return true;
+	}
+
+	const zbyte *packed = s->resident + s->blocks[index];
+	if (s->blocks[index + 1] > (uint32_t)s->resident_size)
+	{
+		if (stored > s->block_size ||
+			(s->packed == NULL && (s->packed = malloc(s->block_size)) == NULL) ||
+			story_read_stored(s, s->blocks[index], s->packed, stored) != stored)
+		{
+			return false;
+		}
+		packed = s->packed;
+	}
+
+	if (lz4_decompress(packed, stored, s->block, length) != length)
+	{
+		return false;
+	}
+	s->block_index = index;
+	return true;
+}
+
+// Find the story chunk of a Blorb file; any other file is the story itself
+static bool story_find_chunk(story_stream_t *s)
+{
+	zbyte header[12];
+	bb_result_t result;
+
+	if (story_read_file(s, 0, header, sizeof(header)) != sizeof(header) ||
+		memcmp(header, "FORM", 4) != 0 || memcmp(header + 8, "IFRS", 4) != 0)
+	{
+		return true; // Not a Blorb file
+	}
+
+	// The port has no pictures or sounds, only the story is looked for
+	bb_map_t *map;
+	if (bb_create_map(s->file, &map) != bb_err_None)
+	{
+		return false;
+	}
+	bool found = bb_load_chunk_by_type(map, bb_method_FilePos, &result, bb_ID_ZCOD, 0) == bb_err_None;
+	bb_destroy_map(map);
+	if (!found)
+	{
+		return false;
+	}
+	s->base = result.data.startpos;
+	s->size = result.length;
+	return true;
+}
+
+// Read the block index of a packed story; a plain story is left as it is
+static bool story_unpack(story_stream_t *s)
+{
+	zbyte header[PACKED_HEADER];
+
+	if (story_read_stored(s, 0, header, sizeof(header)) != sizeof(header) ||
+		memcmp(header, PACKED_MAGIC, 4) != 0)
+	{
+		return true; // Not packed
+	}
+
+	long stored_size = s->size;
+	s->size = get_le32(header + 4);
+	s->block_size = get_le32(header + 8);
+	s->block_count = get_le32(header + 12);
+	s->block_index = -1;
+	if (s->block_size <= 0 || s->block_count != (s->size + s->block_size - 1) / s->block_size ||
+		(s->blocks = malloc((s->block_count + 1) * sizeof(uint32_t))) == NULL)
+	{
+		return false;
+	}
+
+	long index_size = (s->block_count + 1) * sizeof(uint32_t);
+	if (story_read_stored(s, PACKED_HEADER, (zbyte *)s->blocks, index_size) != index_size)
+	{
+		return false;
+	}
+	for (long i = 0; i <= s->block_count; i++)
+	{
+		s->blocks[i] = get_le32((zbyte *)&s->blocks[i]);
+		if (s->blocks[i] > (uint32_t)stored_size || (i > 0 && s->blocks[i] < s->blocks[i - 1]))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static ssize_t story_read(void *cookie, char *buf, size_t size)
+{
+	story_stream_t *s = (story_stream_t *)cookie;
+	long n = MIN((long)size, s->size - s->pos);
+
+	if (n <= 0)
+	{
+		return 0;
+	}
+
+	if (s->pristine != NULL && s->pos < s->dynamic_size)
+	{
+		// Restart, save and restore read dynamic memory from the start; from
+		// anywhere else, decode it again
+		if ((long)s->reader.out > s->pos)
+		{
+			rle_reader_init(&s->reader, s->reader.data, s->reader.size);
+		}
+		rle_read(&s->reader, NULL, s->pos - s->reader.out);
+		n = rle_read(&s->reader, (zbyte *)buf, MIN(n, s->dynamic_size - s->pos));
+	}
+	else if (s->flash != NULL)
+	{
+		memcpy(buf, s->flash + s->pos, n);
+	}
+	else if (s->blocks != NULL)
+	{
+		long index = s->pos / s->block_size;
+		if (index != s->block_index && !story_unpack_block(s, index))
+		{
+			return -1;
+		}
+		long offset = s->pos - index * s->block_size;
+		n = MIN(n, s->block_size - offset);
+		memcpy(buf, s->block + offset, n);
+	}
+	else
+	{
+		n = story_read_stored(s, s->pos, (zbyte *)buf, n);
+		if (n < 0)
+		{
+			return -1;
+		}
+	}
+
+	s->pos += n;
+	return n;
+}
+
+static int story_seek(void *cookie, off_t *offset, int whence)
+{
+	story_stream_t *s = (story_stream_t *)cookie;
+	long pos = *offset;
+
+	if (whence == SEEK_CUR)
+	{
+		pos += s->pos;
+	}
+	else if (whence == SEEK_END)
+	{
+		pos += s->size;
+	}
+	if (pos < 0)
+	{
+		return -1;
+	}
+
+	s->pos = pos;
+	*offset = pos;
+	return 0;
+}
+
+static int story_close(void *cookie)
+{
+	story_stream_t *s = (story_stream_t *)cookie;
+
+	if (s->file != NULL)
+	{
+		fclose(s->file);
+	}
+	free(s->resident);
+	free(s->blocks);
+	free(s->block);
+	free(s->packed);
+	free(s->pristine);
+	memset(s, 0, sizeof(*s));
+	return 0;
+}
+
+// Read the header of a story as the interpreter sees it, with where the story
+// is stored in its file (the story chunk of a Blorb), its size as stored and
+// whether it is packed
+static bool story_header(const char *path, zbyte *header, long *base, long *stored_size, bool *packed)
+{
+	story_stream_t s = {0};
+
+	strncpy(s.path, path, sizeof(s.path) - 1);
+	s.file = fopen(path, "rb");
+	bool read = s.file != NULL && fseek(s.file, 0, SEEK_END) == 0 && (s.size = ftell(s.file)) > 0 &&
+				story_find_chunk(&s);
+	*base = s.base;
+	*stored_size = s.size;
+	read = read && story_unpack(&s) && story_read(&s, (char *)header, 64) == 64;
+	*packed = s.blocks != NULL;
+	story_close(&s);
+	return read;
+}
+
+bool story_plan(const char *path, int budget, plan_t *plan)
+{
+	zbyte header[64];
+	long base;
+	long stored_size;
+	long size;
+	bool packed;
+
+	if (!story_header(path, header, &base, &stored_size, &packed))
+	{
+		return false;
+	}
+
+	// The game has the heap read ahead into, for this story or another one
+	size_t heap = heap_free() + (prefetch.buffer != NULL ? prefetch.size : 0);
+	plan_story(header, stored_size, packed, flash_find_story(header, &size) != NULL, heap, budget, plan);
+	return true;
+}
+
+FILE *story_open(const char *path)
+{
+	cookie_io_functions_t io = {story_read, NULL, story_seek, story_close};
+	zbyte header[64];
+	long size;
+
+	memset(&stream, 0, sizeof(stream));
+	strncpy(stream.path, path, sizeof(stream.path) - 1);
+
+	stream.file = fopen(path, "rb");
+	if (stream.file == NULL || fseek(stream.file, 0, SEEK_END) != 0 || (stream.size = ftell(stream.file)) <= 0 ||
+		!story_find_chunk(&stream) || !story_unpack(&stream) || story_read(&stream, (char *)header, sizeof(header)) != sizeof(header))
+	{
+		story_close(&stream);
+		story_prefetch_cancel();
+		return NULL;
+	}
+	stream.pos = 0;
+
+	// Stories installed in flash need nothing more from the SD card
+	const zbyte *flash = flash_find_story(header, &size);
+	if (flash != NULL)
+	{
+		story_close(&stream);
+		strncpy(stream.path, path, sizeof(stream.path) - 1);
+		stream.flash = flash;
+		stream.size = size;
+		story_prefetch_cancel();
+		return fopencookie(&stream, "rb", io);
+	}
+
+	// Finish reading ahead if the selection did not rest on the story for long
+	if (strcmp(path, prefetch.path) == 0)
+	{
+		prefetch.start_time = get_absolute_time();
+		while (story_prefetch_step())
+		{
+		}
+	}
+
+	if (prefetch.buffer != NULL && prefetch.loaded == prefetch.size && prefetch.base == stream.base)
+	{
+		// Serve the story from the copy already in RAM
+		stream.resident = prefetch.buffer;
+		stream.resident_size = prefetch.size;
+		prefetch.buffer = NULL;
+		fclose(stream.file);
+		stream.file = NULL;
+	}
+	story_prefetch_cancel();
+
+	return fopencookie(&stream, "rb", io);
+}
+
+// Take a compressed copy of dynamic memory as loaded
+static bool story_snapshot(long dynamic_size)
+{
+	zbyte *memory = malloc(dynamic_size);
+	if (memory == NULL)
+	{
+		return false;
+	}
+
+	long pos = stream.pos;
+	long done = 0;
+	long n;
+	stream.pos = 0;
+	while (done < dynamic_size && (n = story_read(&stream, (char *)memory + done, dynamic_size - done)) > 0)
+	{
+		done += n;
+	}
+	stream.pos = pos;
+
+	size_t length = rle_encode(memory, NULL, dynamic_size, NULL);
+	if (done != dynamic_size || (stream.pristine = malloc(length)) == NULL)
+	{
+		free(memory);
+		return false;
+	}
+	rle_encode(memory, NULL, dynamic_size, stream.pristine);
+	free(memory);
+
+	rle_reader_init(&stream.reader, stream.pristine, length);
+	stream.dynamic_size = dynamic_size;
+	return true;
+}
+
+void story_loaded(long dynamic_size)
+{
+	// The interpreter has its own copy now; restart, save and restore read
+	// dynamic memory again, from the snapshot
+	if (story_snapshot(dynamic_size))
+	{
+		free(stream.resident);
+		stream.resident = NULL;
+		stream.resident_size = 0;
+		free(stream.block);
+		free(stream.packed);
+		stream.block = stream.packed = NULL;
+		stream.block_index = -1;
+		return;
+	}
+
+	// Otherwise keep only the part of the story holding dynamic memory
+	long keep = dynamic_size;
+	if (stream.blocks != NULL)
+	{
+		keep = stream.blocks[MIN((dynamic_size + stream.block_size - 1) / stream.block_size, stream.block_count)];
+		free(stream.block);
+		free(stream.packed);
+		stream.block = stream.packed = NULL;
+		stream.block_index = -1;
+	}
+
+	if (stream.resident != NULL && keep < stream.resident_size)
+	{
+		zbyte *resident = realloc(stream.resident, keep);
+		if (resident != NULL)
+		{
+			stream.resident = resident;
+			stream.resident_size = keep;
+		}
+	}
+}
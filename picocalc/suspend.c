@@ -0,0 +1,192 @@
+//
+// suspend.c - PicoCalc interface, suspend to the SD card
+//
+// F9 (or a battery about to run out) writes the game to a single file, the
+// image of a quick save (a Quetzal save and the screen, in a PCsc chunk) with
+// one more chunk of the port: PCst, the settings, the undo budget, the story
+// and its save directory. When
+// the PicoCalc is turned on with this file present, the story is loaded
+// without the selector and the game is restored at its first prompt, with the
+// screen as it was.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#undef bool
+#include "picocalc_frotz.h"
+
+#define SUSPEND_FILE "/Stories/suspend.qzl"
+
+extern uint16_t phosphor;
+
+static bool resume_pending = false; // Found at start up, restored at the first prompt
+
+// Read the whole file, NULL if it is not a suspended game
+static zbyte *suspend_read(size_t *size)
+{
+	FILE *file = fopen(SUSPEND_FILE, "rb");
+	if (file == NULL)
+	{
+		return NULL;
+	}
+
+	long length = -1;
+	zbyte *data = NULL;
+	if (fseek(file, 0, SEEK_END) == 0 && (length = ftell(file)) > 12 && fseek(file, 0, SEEK_SET) == 0 &&
+		(data = malloc(length)) != NULL && fread(data, 1, length, file) != (size_t)length)
+	{
+		free(data);
+		data = NULL;
+	}
+	fclose(file);
+
+	if (data != NULL && (memcmp(data, "FORM", 4) != 0 || memcmp(data + 8, "IFZS", 4) != 0 ||
+						 iff_get32(data + 4) + 8 > (size_t)length))
+	{
+		free(data);
+		data = NULL;
+	}
+	*size = data != NULL ? iff_get32(data + 4) + 8 : 0;
+	return data;
+}
+
+bool suspend_find(char *path, size_t size, story_t *story)
+{
+	size_t data_size;
+	size_t chunk_size;
+
+	zbyte *data = suspend_read(&data_size);
+	if (data == NULL)
+	{
+		return false;
+	}
+
+	// The settings and undo budget, then the story and its save directory,
+	// both terminated
+	const zbyte *chunk = iff_find_chunk(data + 12, data_size - 12, "PCst", &chunk_size);
+	const char *story_file = NULL;
+	const char *save_dir = NULL;
+	if (chunk != NULL && chunk_size > 16)
+	{
+		const char *end = (const char *)chunk + chunk_size;
+		story_file = (const char *)chunk + 16;
+		save_dir = memchr(story_file, '\0', end - story_file);
+		save_dir = save_dir != NULL ? save_dir + 1 : NULL;
+		if (save_dir != NULL && memchr(save_dir, '\0', end - save_dir) == NULL)
+		{
+			save_dir = NULL;
+		}
+	}
+
+	// The story may have been taken off the SD card since
+	FILE *file = NULL;
+	if (save_dir != NULL && strlen(story_file) < size && (file = fopen(story_file, "rb")) != NULL)
+	{
+		fclose(file);
+
+		const char *name = strrchr(save_dir, '/');
+		memset(story, 0, sizeof(story_t));
+		story->settings = iff_get32(chunk + 8);
+		story->undo_budget = (int32_t)iff_get32(chunk + 12);
+		strncpy(story->story_filename, name != NULL ? name + 1 : save_dir, sizeof(story->story_filename) - 1);
+		strcpy(path, story_file);
+		resume_pending = true;
+	}
+	free(data);
+
+	if (!resume_pending)
+	{
+		remove(SUSPEND_FILE); // Of no use any more
+	}
+	return resume_pending;
+}
+
+bool suspend_resume(void)
+{
+	size_t data_size;
+
+	if (!resume_pending)
+	{
+		return false;
+	}
+	resume_pending = false;
+
+	zbyte *data = suspend_read(&data_size);
+	if (data == NULL)
+	{
+		return false;
+	}
+	int success = quick_image_restore(data, data_size);
+	free(data);
+
+	// Resumed once only, the game goes on from here
+	remove(SUSPEND_FILE);
+	if (success < 0)
+	{
+		os_beep(2); // Damaged, the game starts from the beginning
+	}
+	return success > 0;
+}
+
+static bool suspend_write(void)
+{
+	size_t image_size;
+
+	// The game and the screen, as for a quick save
+	char *image = quick_image(&image_size);
+	if (image == NULL)
+	{
+		return false;
+	}
+
+	// The settings as they are now, the phosphor may have been changed
+	zbyte settings[8];
+	iff_put32(settings + 4, undo_budget);
+	iff_put32(settings, SETTINGS_SET | (columns == 64 ? SETTINGS_COLUMNS_64 : 0) |
+							(phosphor == GREEN_PHOSPHOR	  ? SETTINGS_PHOSPHOR_GREEN
+							 : phosphor == AMBER_PHOSPHOR ? SETTINGS_PHOSPHOR_AMBER
+														  : 0));
+	size_t story_size = sizeof(settings) + strlen(f_setup.story_file) + 1 + strlen(f_setup.restricted_path) + 1;
+
+	// The port's chunk goes inside the FORM, after the others
+	iff_put32((zbyte *)image + 4, image_size - 8 + 8 + story_size + (story_size & 1));
+
+	bool written = false;
+	FILE *file = fopen(SUSPEND_FILE, "wb");
+	if (file != NULL)
+	{
+		written = fwrite(image, 1, image_size, file) == image_size &&
+				  iff_write_header(file, "PCst", story_size) &&
+				  fwrite(settings, 1, sizeof(settings), file) == sizeof(settings) &&
+				  fwrite(f_setup.story_file, 1, strlen(f_setup.story_file) + 1, file) == strlen(f_setup.story_file) + 1 &&
+				  fwrite(f_setup.restricted_path, 1, strlen(f_setup.restricted_path) + 1, file) == strlen(f_setup.restricted_path) + 1 &&
+				  ((story_size & 1) == 0 || fputc(0, file) != EOF);
+		written = fclose(file) == 0 && written;
+	}
+	if (!written)
+	{
+		remove(SUSPEND_FILE); // A partial file is not resumed
+	}
+
+	free(image);
+	return written;
+}
+
+void suspend_game(bool critical)
+{
+	if (!suspend_write())
+	{
+		os_beep(2);
+		return;
+	}
+
+	show_message(critical ? "Battery low, suspended. Turn off." : "Suspended. Turn off, or press a key.");
+	os_beep(1);
+
+	// Still on, carry on playing; the game is not resumed again
+	os_read_key(0, FALSE);
+	remove(SUSPEND_FILE);
+	hide_message();
+}
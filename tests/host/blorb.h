@@ -0,0 +1,34 @@
+//
+// blorb.h - host stand-in for Frotz's Blorb library, no file is a Blorb file
+//
+
+#pragma once
+
+#include <stdio.h>
+
+typedef unsigned int uint32;
+typedef int bb_err_t;
+typedef struct bb_map_struct bb_map_t;
+
+#define bb_err_None (0)
+#define bb_err_Format (3)
+#define bb_method_FilePos (2)
+#define bb_ID_ZCOD (0x5A434F44)
+#define bb_ID_Pict (0x50696374)
+#define bb_ID_Snd (0x536E6420)
+
+typedef struct
+{
+	union
+	{
+		void *ptr;
+		uint32 startpos;
+	} data;
+	uint32 length;
+	int chunknum;
+} bb_result_t;
+
+bb_err_t bb_create_map(FILE *file, bb_map_t **newmap);
+bb_err_t bb_destroy_map(bb_map_t *map);
+bb_err_t bb_load_chunk_by_type(bb_map_t *map, int method, bb_result_t *res, uint32 chunktype, int count);
+bb_err_t bb_load_resource(bb_map_t *map, int method, bb_result_t *res, uint32 usage, int resnum);
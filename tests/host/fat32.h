@@ -0,0 +1,8 @@
+//
+// fat32.h - host stand-in for the SD card driver, the C library is used instead
+//
+
+#pragma once
+
+#define FAT32_MAX_PATH_LEN (256)
+#define FAT32_MAX_FILENAME_LEN (255)
@@ -0,0 +1,95 @@
+//
+// frotz.h - host stand-in for the parts of the Frotz core the tests use
+//
+
+#pragma once
+
+#include "defs.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#ifndef bool
+typedef _Bool bool; // The port includes this after #undef bool
+#endif
+
+typedef unsigned char zbyte;
+typedef unsigned short zword;
+typedef unsigned char zchar;
+
+#define TRUE 1
+#define FALSE 0
+#define UNUSED(x) x __attribute__((unused))
+
+#define ZC_TIME_OUT (0x00)
+#define ZC_RETURN (0x0D)
+
+#define V1 1
+#define V2 2
+#define V3 3
+#define V4 4
+#define V5 5
+#define V6 6
+#define V7 7
+#define V8 8
+
+#define H_VERSION 0
+#define H_CONFIG 1
+#define H_RELEASE 2
+#define H_RESIDENT_SIZE 4
+#define H_START_PC 6
+#define H_DICTIONARY 8
+#define H_OBJECTS 10
+#define H_GLOBALS 12
+#define H_DYNAMIC_SIZE 14
+#define H_FLAGS 16
+#define H_SERIAL 18
+#define H_ABBREVIATIONS 24
+#define H_FILE_SIZE 26
+#define H_CHECKSUM 28
+
+typedef struct
+{
+	zbyte version;
+	zbyte config;
+	zword release;
+	zword resident_size;
+	zword start_pc;
+	zword dictionary;
+	zword objects;
+	zword globals;
+	zword dynamic_size;
+	zword flags;
+	zbyte serial[6];
+	zword abbreviations;
+	zword file_size;
+	zword checksum;
+} z_header_t;
+
+typedef struct
+{
+	int undo_slots;
+	char *story_file;
+	char *restricted_path;
+	char *tmp_save_name;
+	int restore_mode;
+} f_setup_t;
+
+extern z_header_t z_header;
+extern f_setup_t f_setup;
+extern zbyte *zmp;
+extern zbyte *pcp;
+extern FILE *story_fp;
+extern zword stack[STACK_SIZE];
+extern zword *sp;
+extern zword *fp;
+extern zword zargs[8];
+extern int zargc;
+
+void restart_header(void);
+void split_window(zword height);
+zchar os_read_key(int timeout, bool show_cursor);
+void os_beep(int number);
+void os_fatal(const char *s, ...);
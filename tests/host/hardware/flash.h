@@ -0,0 +1,8 @@
+//
+// flash.h - host stand-in for the Pico SDK, the flash geometry only
+//
+
+#pragma once
+
+#define FLASH_SECTOR_SIZE (4096u)
+#define FLASH_PAGE_SIZE (256u)
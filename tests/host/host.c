@@ -0,0 +1,202 @@
+//
+// host.c - the PicoCalc as seen by the host tests
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host.h"
+#include "blorb.h"
+#include "hardware/flash.h"
+
+int test_failures = 0;
+
+int test_result(void)
+{
+	if (test_failures > 0)
+	{
+		fprintf(stderr, "%d check(s) failed\n", test_failures);
+		return 1;
+	}
+	printf("ok\n");
+	return 0;
+}
+
+// The core's globals, for the port files that use them
+z_header_t z_header;
+f_setup_t f_setup;
+zbyte *zmp = NULL;
+zbyte *pcp = NULL;
+FILE *story_fp = NULL;
+zword stack[STACK_SIZE];
+zword *sp = stack + STACK_SIZE;
+zword *fp = stack + STACK_SIZE;
+zword zargs[8];
+int zargc;
+
+// The end of the heap from the linker script, only used to find the heap free
+char __HeapLimit;
+
+// No file is a Blorb file
+bb_err_t bb_create_map(FILE *UNUSED(file), bb_map_t **UNUSED(newmap))
+{
+	return bb_err_Format;
+}
+
+bb_err_t bb_destroy_map(bb_map_t *UNUSED(map))
+{
+	return bb_err_None;
+}
+
+bb_err_t bb_load_chunk_by_type(bb_map_t *UNUSED(map), int UNUSED(method), bb_result_t *UNUSED(res),
+							   uint32 UNUSED(chunktype), int UNUSED(count))
+{
+	return bb_err_Format;
+}
+
+bb_err_t bb_load_resource(bb_map_t *UNUSED(map), int UNUSED(method), bb_result_t *UNUSED(res),
+						  uint32 UNUSED(usage), int UNUSED(resnum))
+{
+	return bb_err_Format;
+}
+
+// The store is a buffer written through to a file. Like flash, erasing sets
+// whole sectors to 0xFF and programming whole pages can only clear bits.
+static zbyte store_flash[HOST_STORE_SIZE];
+int host_store_errors = 0;
+
+static void store_write_through(uint32_t offset, size_t size)
+{
+	FILE *file = fopen(HOST_STORE_FILE, "r+b");
+	if (file == NULL || fseek(file, offset, SEEK_SET) != 0 ||
+		fwrite(store_flash + offset, 1, size, file) != size)
+	{
+		host_store_errors++;
+	}
+	if (file != NULL)
+	{
+		fclose(file);
+	}
+}
+
+static void store_erase(uint32_t offset, size_t size)
+{
+	if (offset % FLASH_SECTOR_SIZE != 0 || size % FLASH_SECTOR_SIZE != 0 || offset + size > HOST_STORE_SIZE)
+	{
+		host_store_errors++;
+		return;
+	}
+	memset(store_flash + offset, 0xFF, size);
+	store_write_through(offset, size);
+}
+
+static void store_program(uint32_t offset, const zbyte *data, size_t size)
+{
+	if (offset % FLASH_PAGE_SIZE != 0 || size % FLASH_PAGE_SIZE != 0 || offset + size > HOST_STORE_SIZE)
+	{
+		host_store_errors++;
+		return;
+	}
+	for (size_t i = 0; i < size; i++)
+	{
+		if ((data[i] & ~store_flash[offset + i]) != 0)
+		{
+			host_store_errors++; // Setting a bit needs an erase
+		}
+		store_flash[offset + i] &= data[i];
+	}
+	store_write_through(offset, size);
+}
+
+static const flash_store_t host_store = {
+	.base = store_flash,
+	.size = HOST_STORE_SIZE,
+	.erase = store_erase,
+	.program = store_program,
+};
+
+const flash_store_t *flash_store_open(void)
+{
+	return &host_store;
+}
+
+void host_store_erase(void)
+{
+	memset(store_flash, 0xFF, sizeof(store_flash));
+	host_store_errors = host_write_file(HOST_STORE_FILE, store_flash, sizeof(store_flash)) ? 0 : 1;
+}
+
+void host_store_reload(void)
+{
+	memset(store_flash, 0, sizeof(store_flash));
+	FILE *file = fopen(HOST_STORE_FILE, "rb");
+	if (file == NULL || fread(store_flash, 1, sizeof(store_flash), file) != sizeof(store_flash))
+	{
+		host_store_errors++;
+	}
+	if (file != NULL)
+	{
+		fclose(file);
+	}
+}
+
+bool host_write_file(const char *path, const void *data, size_t size)
+{
+	FILE *file = fopen(path, "wb");
+	if (file == NULL)
+	{
+		return false;
+	}
+	bool written = fwrite(data, 1, size, file) == size;
+	return fclose(file) == 0 && written;
+}
+
+zbyte *host_read_file(const char *path, long *size)
+{
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+	{
+		return NULL;
+	}
+	zbyte *data = NULL;
+	if (fseek(file, 0, SEEK_END) != 0 || (*size = ftell(file)) < 0 || fseek(file, 0, SEEK_SET) != 0 ||
+		(data = malloc(*size + 1)) == NULL || fread(data, 1, *size, file) != (size_t)*size)
+	{
+		free(data);
+		data = NULL;
+	}
+	fclose(file);
+	return data;
+}
+
+zbyte *host_story(int version, int release, long length, long dynamic_size, unsigned seed)
+{
+	long scale = version <= V3 ? 2 : version <= V5 ? 4 : 8;
+	zbyte *story = calloc(1, length);
+
+	srand(seed);
+	for (long i = dynamic_size; i < length; i++)
+	{
+		story[i] = rand();
+	}
+
+	// Runs of zeros, as in the object table and arrays, among values and text
+	for (long i = 64; i < dynamic_size; i++)
+	{
+		int kind = (i / 256 + seed) % 4;
+		story[i] = kind == 0 ? 0 : kind == 1 ? (i % 9 == 0 ? rand() : 0) : kind == 2 ? 'a' + rand() % 26 : rand();
+	}
+
+	story[H_VERSION] = version;
+	story[H_RELEASE] = release >> 8;
+	story[H_RELEASE + 1] = release;
+	story[H_DYNAMIC_SIZE] = dynamic_size >> 8;
+	story[H_DYNAMIC_SIZE + 1] = dynamic_size;
+	snprintf((char *)&story[H_SERIAL], 7, "%06u", seed % 1000000);
+	story[H_FILE_SIZE] = (length / scale) >> 8;
+	story[H_FILE_SIZE + 1] = length / scale;
+	story[H_CHECKSUM] = seed >> 8;
+	story[H_CHECKSUM + 1] = seed;
+	return story;
+}
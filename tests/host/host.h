@@ -0,0 +1,43 @@
+//
+// host.h - the PicoCalc as seen by the host tests
+//
+
+#pragma once
+
+#include <stdio.h>
+
+#undef bool
+#include "picocalc_frotz.h"
+
+// Report a failed check and carry on, main() returns test_result()
+#define CHECK(condition)                                                         \
+	do                                                                           \
+	{                                                                            \
+		if (!(condition))                                                        \
+		{                                                                        \
+			fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #condition); \
+			test_failures++;                                                     \
+		}                                                                        \
+	} while (0)
+
+extern int test_failures;
+int test_result(void);
+
+// The flash store, kept in a file as flash keeps it through a power cycle
+#define HOST_STORE_FILE "flash_store.bin"
+#define HOST_STORE_SIZE (1024 * 1024)
+
+extern int host_store_errors; // Writes flash could not have done
+void host_store_erase(void);  // As flash never written
+void host_store_reload(void); // As after a power cycle
+
+// Write a file, false if it could not be
+bool host_write_file(const char *path, const void *data, size_t size);
+
+// Read a whole file, NULL if it could not be; free() the result
+zbyte *host_read_file(const char *path, long *size);
+
+// A story for the tests: a header with the release, serial number and
+// checksum given, then dynamic memory shaped like a real one (mostly zero,
+// with tables and strings) and random static and high memory
+zbyte *host_story(int version, int release, long length, long dynamic_size, unsigned seed);
@@ -0,0 +1,29 @@
+//
+// stdlib.h - host stand-in for the Pico SDK, the time functions only
+//
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+typedef uint64_t absolute_time_t;
+
+static inline absolute_time_t get_absolute_time(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (absolute_time_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static inline absolute_time_t make_timeout_time_ms(uint32_t ms)
+{
+	return get_absolute_time() + (absolute_time_t)ms * 1000;
+}
+
+static inline int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to)
+{
+	return (int64_t)(to - from);
+}
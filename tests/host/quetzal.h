@@ -0,0 +1,8 @@
+//
+// quetzal.h - host stand-in for Frotz's save and restore
+//
+
+#pragma once
+
+zword save_quetzal(FILE *svf, FILE *stf);
+zword restore_quetzal(FILE *svf, FILE *stf);
@@ -0,0 +1,99 @@
+//
+// test_flash.c - installing stories in a store kept in a file
+//
+
+#include <string.h>
+
+#include "host.h"
+
+static int last_percent = -1;
+
+static void progress(int percent)
+{
+	last_percent = percent;
+}
+
+// Stories are installed as they are stored, none of them is packed
+FILE *story_open(const char *path)
+{
+	return fopen(path, "rb");
+}
+
+// Write a story file, returning the story
+static zbyte *make_story(const char *path, int release, long length, unsigned seed)
+{
+	zbyte *story = host_story(V5, release, length, 0x2000, seed);
+	CHECK(host_write_file(path, story, length));
+	return story;
+}
+
+static bool installed(const zbyte *story, long length)
+{
+	long found_length = 0;
+	const zbyte *found = flash_find_story(story, &found_length);
+	return found != NULL && found_length == length && memcmp(found, story, length) == 0;
+}
+
+int main(void)
+{
+	host_store_erase();
+
+	// Nothing is found in flash never written
+	zbyte *first = make_story("first.z5", 1, 100000, 1);
+	CHECK(!installed(first, 100000));
+
+	CHECK(flash_install_story("first.z5", progress) == FLASH_INSTALLED);
+	CHECK(last_percent >= 90 && last_percent < 100);
+	CHECK(installed(first, 100000));
+	CHECK(flash_install_story("first.z5", progress) == FLASH_ALREADY_INSTALLED);
+
+	// A second story goes after the first, on a sector boundary
+	zbyte *second = make_story("second.z5", 2, 4096 * 3 + 1, 2);
+	CHECK(flash_install_story("second.z5", progress) == FLASH_INSTALLED);
+	CHECK(installed(first, 100000));
+	CHECK(installed(second, 4096 * 3 + 1));
+
+	// The same story from another release is another story
+	zbyte *update = make_story("update.z5", 3, 100000, 1);
+	CHECK(!installed(update, 100000));
+
+	// Both are still there after a power cycle
+	host_store_reload();
+	CHECK(installed(first, 100000));
+	CHECK(installed(second, 4096 * 3 + 1));
+
+	// Larger than the store
+	free(make_story("large.z5", 4, HOST_STORE_SIZE, 4));
+	CHECK(flash_install_story("large.z5", progress) == FLASH_TOO_LARGE);
+	CHECK(flash_install_story("missing.z5", progress) == FLASH_READ_ERROR);
+
+	// Once full, the store starts again with the story being installed
+	zbyte *stories[16];
+	int count = 0;
+	for (; count < 16; count++)
+	{
+		char path[32];
+		snprintf(path, sizeof(path), "fill%d.z5", count);
+		stories[count] = make_story(path, 100 + count, 150000, 100 + count);
+		CHECK(flash_install_story(path, progress) == FLASH_INSTALLED);
+		if (!installed(first, 100000))
+		{
+			break;
+		}
+	}
+	CHECK(count < 16);
+	CHECK(installed(stories[count], 150000));
+	CHECK(!installed(second, 4096 * 3 + 1));
+	CHECK(!installed(stories[0], 150000));
+
+	CHECK(host_store_errors == 0);
+
+	for (int i = 0; i <= count && i < 16; i++)
+	{
+		free(stories[i]);
+	}
+	free(first);
+	free(second);
+	free(update);
+	return test_result();
+}
@@ -0,0 +1,285 @@
+//
+// test_packed.c - stories packed by tools/zlz.py read back as the story
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "host.h"
+
+#define PACKED_HEADER (16) // As in story.c
+
+static zbyte memory[0x20000];
+
+static uint32_t get_le32(const zbyte *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_le32(zbyte *p, uint32_t n)
+{
+	p[0] = n;
+	p[1] = n >> 8;
+	p[2] = n >> 16;
+	p[3] = n >> 24;
+}
+
+// Pack with the tool itself, ZLZ_COMMAND is set by CMakeLists.txt
+static bool pack(const char *story, const char *packed, int block_size)
+{
+	char command[1024];
+	snprintf(command, sizeof(command), "%s -b %d -o %s %s >/dev/null", ZLZ_COMMAND, block_size, packed, story);
+	return system(command) == 0;
+}
+
+static double seconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Load as the core does: the header, then the whole story
+static bool load(FILE *file, long length)
+{
+	return fseek(file, 0, SEEK_SET) == 0 && fread(memory, 1, 64, file) == 64 &&
+		   fread(memory + 64, 1, length - 64, file) == (size_t)length - 64;
+}
+
+// Read n bytes from pos, as many as there are before the end
+static bool read_at(FILE *file, const zbyte *story, long length, long pos, long n)
+{
+	long expected = MAX(0, MIN(n, length - pos));
+	memset(memory, 0xAA, n);
+	return fseek(file, pos, SEEK_SET) == 0 && fread(memory, 1, n, file) == (size_t)expected &&
+		   memcmp(memory, story + pos, expected) == 0;
+}
+
+static void check_reads(FILE *file, const zbyte *story, long length, long block_size)
+{
+	// Across each block boundary, and from the start and end of each block
+	bool same = true;
+	for (long start = block_size; start < length; start += block_size)
+	{
+		same = same && read_at(file, story, length, start - 7, 20);
+		same = same && read_at(file, story, length, start, 1);
+		same = same && read_at(file, story, length, start - 1, 1);
+	}
+	CHECK(same);
+
+	// Anywhere, over several blocks, and past the end
+	same = true;
+	for (int i = 0; i < 500; i++)
+	{
+		long pos = rand() % length;
+		same = same && read_at(file, story, length, pos, 1 + rand() % MIN(3 * block_size, (long)sizeof(memory)));
+	}
+	CHECK(same);
+	CHECK(read_at(file, story, length, length - 10, 100));
+	CHECK(read_at(file, story, length, length, 10));
+}
+
+// Pack a story, then read it back as the interpreter does; the packed file
+// is left for the damaged copies
+static zbyte *check_packed(const char *name, int version, long length, long dynamic_size, long block_size,
+						   unsigned seed, zbyte **story_out, long *packed_size)
+{
+	char raw_path[64];
+	char packed_path[64];
+	snprintf(raw_path, sizeof(raw_path), "%s.z%d", name, version);
+	snprintf(packed_path, sizeof(packed_path), "%s.zlz", name);
+
+	zbyte *story = host_story(version, 1, length, dynamic_size, seed);
+	*story_out = story;
+	CHECK(host_write_file(raw_path, story, length));
+	CHECK(pack(raw_path, packed_path, block_size));
+	zbyte *packed = host_read_file(packed_path, packed_size);
+	CHECK(packed != NULL);
+	if (packed == NULL)
+	{
+		return NULL;
+	}
+
+	// Dynamic memory compresses, the random rest is stored as it is
+	long count = get_le32(packed + 12);
+	int raw = 0;
+	int compressed = 0;
+	for (long i = 0; i < count; i++)
+	{
+		long stored = get_le32(packed + PACKED_HEADER + 4 * (i + 1)) - get_le32(packed + PACKED_HEADER + 4 * i);
+		if (stored == MIN(block_size, length - i * block_size))
+		{
+			raw++;
+		}
+		else
+		{
+			compressed++;
+		}
+	}
+	CHECK(get_le32(packed + 8) == (uint32_t)block_size && raw > 0 && compressed > 0);
+
+	// Loaded, then read back from anywhere before and after the snapshot
+	double started = seconds();
+	FILE *file = story_open(packed_path);
+	CHECK(file != NULL);
+	if (file == NULL)
+	{
+		return packed;
+	}
+	CHECK(load(file, length));
+	double packed_time = seconds() - started;
+	CHECK(memcmp(memory, story, length) == 0);
+	check_reads(file, story, length, block_size);
+
+	story_loaded(dynamic_size);
+	check_reads(file, story, length, block_size);
+	CHECK(fseek(file, 0, SEEK_SET) == 0);
+	bool same = true;
+	for (long i = 0; i < dynamic_size; i++)
+	{
+		same = same && fgetc(file) == story[i];
+	}
+	CHECK(same);
+	CHECK(load(file, length));
+	CHECK(memcmp(memory, story, length) == 0);
+	fclose(file);
+
+	// The same story unpacked, for the time it takes on the host; the
+	// PicoCalc's SD card is far slower, where reading less matters more
+	started = seconds();
+	file = story_open(raw_path);
+	CHECK(file != NULL && load(file, length));
+	double raw_time = seconds() - started;
+	if (file != NULL)
+	{
+		fclose(file);
+	}
+	printf("%s: %ld -> %ld bytes, loaded on the host in %.0f us (%.0f us unpacked)\n", packed_path, length,
+		   *packed_size, packed_time * 1e6, raw_time * 1e6);
+	return packed;
+}
+
+// A damaged packed story is not opened, or fails to read; never out of bounds
+static void check_damaged(const zbyte *packed, long packed_size, long length)
+{
+	zbyte *copy = malloc(packed_size);
+	long count = get_le32(packed + 12);
+	long index_end = PACKED_HEADER + 4 * (count + 1);
+	FILE *file;
+
+	// Cut short: in the header, in the index, in the blocks, by a byte
+	long cuts[] = {10, PACKED_HEADER + 6, index_end + 100, packed_size / 2, packed_size - 1};
+	for (size_t i = 0; i < sizeof(cuts) / sizeof(cuts[0]); i++)
+	{
+		CHECK(host_write_file("damaged.zlz", packed, cuts[i]));
+		file = story_open("damaged.zlz");
+		CHECK(file == NULL);
+		if (file != NULL)
+		{
+			fclose(file);
+		}
+	}
+
+	// An index that does not fit the story, out of order, or past the end
+	memcpy(copy, packed, packed_size);
+	put_le32(copy + 12, count + 1);
+	CHECK(host_write_file("damaged.zlz", copy, packed_size) && story_open("damaged.zlz") == NULL);
+	memcpy(copy, packed, packed_size);
+	put_le32(copy + 8, 0);
+	CHECK(host_write_file("damaged.zlz", copy, packed_size) && story_open("damaged.zlz") == NULL);
+	memcpy(copy, packed, packed_size);
+	put_le32(copy + PACKED_HEADER + 8, get_le32(packed + PACKED_HEADER) - 1);
+	CHECK(host_write_file("damaged.zlz", copy, packed_size) && story_open("damaged.zlz") == NULL);
+	memcpy(copy, packed, packed_size);
+	put_le32(copy + index_end - 4, packed_size + 1);
+	CHECK(host_write_file("damaged.zlz", copy, packed_size) && story_open("damaged.zlz") == NULL);
+
+	// The first block holds the header, without it the story is not opened
+	memcpy(copy, packed, packed_size);
+	memset(copy + get_le32(packed + PACKED_HEADER), 0xFF, get_le32(packed + PACKED_HEADER + 4) - get_le32(packed + PACKED_HEADER));
+	CHECK(host_write_file("damaged.zlz", copy, packed_size) && story_open("damaged.zlz") == NULL);
+
+	// A later block cut to a byte, the next one taking the rest, fails to read
+	long block_size = get_le32(packed + 8);
+	memcpy(copy, packed, packed_size);
+	put_le32(copy + PACKED_HEADER + 8, get_le32(packed + PACKED_HEADER + 4) + 1);
+	CHECK(host_write_file("damaged.zlz", copy, packed_size));
+	file = story_open("damaged.zlz");
+	CHECK(file != NULL);
+	if (file != NULL)
+	{
+		CHECK(!load(file, length));
+		fclose(file);
+	}
+
+	// Bytes of a compressed block changed at random: the story reads back the
+	// same, with other bytes, or fails, and the sanitizer sees any overrun
+	long compressed[count];
+	int compressed_count = 0;
+	for (long i = 1; i < count; i++)
+	{
+		long stored = get_le32(packed + PACKED_HEADER + 4 * (i + 1)) - get_le32(packed + PACKED_HEADER + 4 * i);
+		if (stored != MIN(block_size, length - i * block_size))
+		{
+			compressed[compressed_count++] = i; // Any bytes will do in one stored as it is
+		}
+	}
+	int failed = 0;
+	for (int t = 0; t < 300 && compressed_count > 0; t++)
+	{
+		long index = compressed[rand() % compressed_count];
+		long start = get_le32(packed + PACKED_HEADER + 4 * index);
+		long stored = get_le32(packed + PACKED_HEADER + 4 * (index + 1)) - start;
+		memcpy(copy, packed, packed_size);
+		for (int n = 1 + rand() % 4; n > 0; n--)
+		{
+			copy[start + rand() % stored] = rand();
+		}
+		CHECK(host_write_file("damaged.zlz", copy, packed_size));
+		file = story_open("damaged.zlz");
+		CHECK(file != NULL);
+		if (file != NULL)
+		{
+			failed += !load(file, length);
+			fclose(file);
+		}
+	}
+	CHECK(compressed_count == 0 || failed > 0);
+
+	free(copy);
+}
+
+int main(void)
+{
+	static const struct
+	{
+		const char *name;
+		int version;
+		long length;
+		long dynamic_size;
+		long block_size;
+	} stories[] = {
+		{"packed", V5, 0x1C000, 0x9E40, 4096},
+		{"small_blocks", V3, 0x8000, 0x1000, 256},
+		{"large_blocks", V8, 0x20000, 0xFFF8, 65536},
+		{"odd_end", V5, 0x10000 - 4 * 37, 0x4321, 1000},
+	};
+
+	srand(34);
+	host_store_erase();
+	for (size_t i = 0; i < sizeof(stories) / sizeof(stories[0]); i++)
+	{
+		zbyte *story;
+		long packed_size;
+		zbyte *packed = check_packed(stories[i].name, stories[i].version, stories[i].length, stories[i].dynamic_size,
+									 stories[i].block_size, 100 + i, &story, &packed_size);
+		if (packed != NULL)
+		{
+			check_damaged(packed, packed_size, stories[i].length);
+		}
+		free(packed);
+		free(story);
+	}
+	return test_result();
+}
@@ -0,0 +1,175 @@
+//
+// test_plan.c - how stories are loaded and their undo levels, at the edges
+//
+
+#include <string.h>
+
+#include "host.h"
+
+// As in story.c
+#define PREFETCH_RESERVE (32 * 1024)
+#define UNDO_RESERVE (16 * 1024)
+#define UNDO_CHANGED (32)
+#define UNDO_LEVEL_OVERHEAD (512)
+
+// Headers shaped like those of released stories: the length word (scaled by
+// the version), dynamic memory, and the file as found on the SD card
+static const struct
+{
+	const char *name;
+	int version;
+	unsigned length_word; // 0 in early stories
+	unsigned dynamic_size;
+	long file_size;
+	bool packed; // The file is smaller than the story
+} stories[] = {
+	{"V1, no length", 1, 0, 0x1B00, 0x12A00, false},
+	{"V3, small", 3, 0x4A00, 0x2E00, 0x9400, false},
+	{"V3, largest", 3, 0xFFFF, 0x3FC0, 0x1FFFE, false},
+	{"V3, packed", 3, 0xA000, 0x2E00, 0x9800, true},
+	{"V4", 4, 0xC800, 0x5D00, 0x32000, false},
+	{"V5", 5, 0xA400, 0x7A00, 0x29000, false},
+	{"V5, packed", 5, 0xFFFF, 0xB800, 0x1C000, true},
+	{"V8", 8, 0x8000, 0xF000, 0x40000, false},
+	{"V8, in a Blorb", 8, 0x7000, 0xFFFF, 0x3C000, false},
+};
+
+static void set_header(zbyte *header, int version, unsigned length_word, unsigned dynamic_size)
+{
+	memset(header, 0, 64);
+	header[H_VERSION] = version;
+	header[H_FILE_SIZE] = length_word >> 8;
+	header[H_FILE_SIZE + 1] = length_word & 0xFF;
+	header[H_DYNAMIC_SIZE] = dynamic_size >> 8;
+	header[H_DYNAMIC_SIZE + 1] = dynamic_size & 0xFF;
+}
+
+static plan_t plan_for(const zbyte *header, long file_size, bool packed, bool in_flash, size_t heap, int budget)
+{
+	plan_t plan;
+	memset(&plan, 0xAA, sizeof(plan));
+	plan_story(header, file_size, packed, in_flash, heap, budget, &plan);
+	return plan;
+}
+
+static void check_modes(int n)
+{
+	zbyte header[64];
+	set_header(header, stories[n].version, stories[n].length_word, stories[n].dynamic_size);
+
+	int version = stories[n].version;
+	long scale = version <= 3 ? 2 : version <= 5 ? 4 : 8;
+	long story_size = stories[n].length_word > 0 ? (long)stories[n].length_word * scale : stories[n].file_size;
+	long file_size = stories[n].file_size;
+	bool packed = stories[n].packed;
+	size_t needed = story_size + stories[n].dynamic_size;
+	size_t fits = needed + PREFETCH_RESERVE;
+	size_t ram = MAX(2 * (size_t)file_size + PREFETCH_RESERVE, fits);
+	plan_t plan;
+
+	// One byte short of the story, its snapshot and the reserve
+	plan = plan_for(header, file_size, packed, false, fits - 1, UNDO_AUTO);
+	CHECK(plan.mode == PLAN_TOO_LARGE);
+	CHECK(plan.story_size == story_size);
+	CHECK(plan.undo_levels == 0);
+	CHECK(plan.heap_left == PREFETCH_RESERVE - 1);
+
+	// Installed in flash, it is still loaded into the heap
+	plan = plan_for(header, file_size, packed, true, fits - 1, UNDO_AUTO);
+	CHECK(plan.mode == PLAN_TOO_LARGE);
+	plan = plan_for(header, file_size, packed, true, fits, UNDO_AUTO);
+	CHECK(plan.mode == PLAN_FLASH);
+	CHECK(plan.heap_left == PREFETCH_RESERVE);
+
+	// Read ahead once the file fits beside the interpreter's copy
+	plan = plan_for(header, file_size, packed, false, ram, UNDO_AUTO);
+	CHECK(plan.mode == (packed ? PLAN_PACKED_RAM : PLAN_RAM));
+	CHECK(plan.story_size == story_size);
+	CHECK(plan.heap_left == ram - needed);
+	if (ram > fits)
+	{
+		plan = plan_for(header, file_size, packed, false, ram - 1, UNDO_AUTO);
+		CHECK(plan.mode == PLAN_SD);
+		plan = plan_for(header, file_size, packed, false, fits, UNDO_AUTO);
+		CHECK(plan.mode == PLAN_SD);
+		CHECK(plan.heap_left == PREFETCH_RESERVE);
+	}
+
+	// The mode does not depend on the undo budget
+	plan = plan_for(header, file_size, packed, false, ram, UNDO_OFF);
+	CHECK(plan.mode == (packed ? PLAN_PACKED_RAM : PLAN_RAM));
+	CHECK(plan.undo_levels == 0);
+
+	// Nor on the heap beyond, up to that of a PicoCalc with a Pico 2 W
+	plan = plan_for(header, file_size, packed, false, 8 * 1024 * 1024, UNDO_AUTO);
+	CHECK(plan.mode == (packed ? PLAN_PACKED_RAM : PLAN_RAM));
+	CHECK(plan.undo_levels == (version >= 5 ? MAX_UNDO_LEVELS : 0));
+}
+
+static void check_undo(int n)
+{
+	int version = stories[n].version;
+	long dynamic_size = stories[n].dynamic_size;
+	size_t fixed = dynamic_size * 5 / 2 + 2; // Taken by init_undo() for every story
+	size_t level = dynamic_size / UNDO_CHANGED + UNDO_LEVEL_OVERHEAD;
+
+	if (version < 5)
+	{
+		CHECK(undo_levels(version, dynamic_size, 8 * 1024 * 1024, UNDO_AUTO) == 0);
+		CHECK(undo_levels(version, dynamic_size, fixed + UNDO_RESERVE - 1, 1024) == 0);
+		CHECK(undo_levels(version, dynamic_size, 8 * 1024 * 1024, 1024) == 0);
+		return;
+	}
+
+	CHECK(undo_levels(version, dynamic_size, 8 * 1024 * 1024, UNDO_OFF) == 0);
+
+	// What init_undo() takes and the reserve must fit
+	CHECK(undo_levels(version, dynamic_size, fixed + UNDO_RESERVE - 1, UNDO_AUTO) == 0);
+	CHECK(undo_levels(version, dynamic_size, fixed + UNDO_RESERVE + level, 1024) == 1);
+	CHECK(undo_levels(version, dynamic_size, fixed + UNDO_RESERVE + level - 1, 1024) == 0);
+
+	// The automatic budget is half the heap left over the reserve
+	size_t heap = UNDO_RESERVE + fixed + 2 * 3 * level;
+	CHECK(undo_levels(version, dynamic_size, heap, UNDO_AUTO) == 3);
+	CHECK(undo_levels(version, dynamic_size, heap - 2, UNDO_AUTO) == 2);
+
+	// A budget in kilobytes, whole levels only, and no more than Frotz keeps
+	for (int levels = 1; levels <= MAX_UNDO_LEVELS + 5; levels++)
+	{
+		size_t bytes = levels * level;
+		int budget = (bytes + 1023) / 1024;
+		int expected = MIN((size_t)budget * 1024 / level, MAX_UNDO_LEVELS);
+		CHECK(undo_levels(version, dynamic_size, 8 * 1024 * 1024, budget) == expected);
+		CHECK(expected >= MIN(levels, MAX_UNDO_LEVELS));
+	}
+	CHECK(undo_levels(version, dynamic_size, 8 * 1024 * 1024, 8 * 1024) == MAX_UNDO_LEVELS);
+
+	// The budget is cut to the heap there is
+	heap = UNDO_RESERVE + fixed + 2 * level;
+	CHECK(undo_levels(version, dynamic_size, heap, 8 * 1024) == 2);
+
+	// The plan gives the levels of the heap left once the story is loaded
+	zbyte header[64];
+	set_header(header, version, stories[n].length_word, dynamic_size);
+	long story_size = (long)stories[n].length_word * (version <= 5 ? 4 : 8);
+	plan_t plan = plan_for(header, stories[n].file_size, stories[n].packed, true,
+						   story_size + dynamic_size + PREFETCH_RESERVE + heap, 8 * 1024);
+	CHECK(plan.mode == PLAN_FLASH);
+	CHECK(plan.heap_left == PREFETCH_RESERVE + heap);
+	CHECK(plan.undo_levels == undo_levels(version, dynamic_size, PREFETCH_RESERVE + heap, 8 * 1024));
+}
+
+int main(void)
+{
+	for (size_t i = 0; i < sizeof(stories) / sizeof(stories[0]); i++)
+	{
+		int failures = test_failures;
+		check_modes(i);
+		check_undo(i);
+		if (test_failures > failures)
+		{
+			fprintf(stderr, "in story: %s\n", stories[i].name);
+		}
+	}
+	return test_result();
+}
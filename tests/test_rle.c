@@ -0,0 +1,140 @@
+//
+// test_rle.c - zero run-length coding against a byte at a time reference
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "host.h"
+
+#define RLE_BUFFERS (200000)
+#define RLE_LONGEST (1200) // Runs of zeros longer than a count can hold
+
+// The coding as Frotz does it in the CMem chunk, one byte at a time
+static size_t reference_encode(const zbyte *data, const zbyte *base, size_t size, zbyte *out)
+{
+	size_t length = 0;
+	size_t i = 0;
+
+	while (i < size)
+	{
+		zbyte b = base != NULL ? data[i] ^ base[i] : data[i];
+		i++;
+		if (b != 0)
+		{
+			out[length++] = b;
+			continue;
+		}
+
+		size_t run = 0;
+		while (i < size && run < 255 && (base != NULL ? data[i] ^ base[i] : data[i]) == 0)
+		{
+			run++;
+			i++;
+		}
+		out[length++] = 0;
+		out[length++] = run;
+	}
+	return length;
+}
+
+// Read it back in pieces of random length, as the story stream does; with
+// known, some pieces are skipped and taken from it
+static bool read_back(const zbyte *coded, size_t length, zbyte *out, size_t size, const zbyte *known)
+{
+	rle_reader_t reader;
+	size_t done = 0;
+
+	rle_reader_init(&reader, coded, length);
+	while (done < size)
+	{
+		size_t n = 1 + rand() % 300;
+		bool skip = known != NULL && rand() % 8 == 0;
+		size_t got = rle_read(&reader, skip ? NULL : out + done, n);
+		if (got == 0 || got > n || reader.out != done + got)
+		{
+			return false;
+		}
+		if (got < n && done + got != size)
+		{
+			return false; // Short before the end of the data
+		}
+		if (skip)
+		{
+			memcpy(out + done, known + done, got);
+		}
+		done += got;
+	}
+	return rle_read(&reader, out, 1) == 0;
+}
+
+int main(void)
+{
+	srand(45);
+	for (int t = 0; t < RLE_BUFFERS; t++)
+	{
+		// Data and base aligned alike or not, sparse to dense
+		size_t size = rand() % 8 == 0 ? rand() % RLE_LONGEST : rand() % 600;
+		zbyte *data_block = malloc(size + 8);
+		zbyte *base_block = malloc(size + 8);
+		zbyte *data = data_block + rand() % 4;
+		zbyte *base = base_block + rand() % 4;
+		int density = rand() % 100;
+		for (size_t i = 0; i < size; i++)
+		{
+			data[i] = rand() % 100 < density ? rand() : 0;
+			base[i] = rand() % 100 < density / 2 ? rand() : data[i];
+		}
+		const zbyte *use_base = rand() % 2 ? base : NULL;
+
+		// The worst case is a lone zero in every other byte
+		zbyte *expected = malloc(size * 3 / 2 + 2);
+		zbyte *coded = malloc(size * 3 / 2 + 2);
+		size_t expected_length = reference_encode(data, use_base, size, expected);
+		size_t length = rle_encode(data, use_base, size, NULL);
+		CHECK(length == expected_length);
+		if (length == expected_length)
+		{
+			CHECK(rle_encode(data, use_base, size, coded) == length);
+			CHECK(memcmp(coded, expected, length) == 0);
+		}
+
+		// Decoded, and XORed again with the base, it is the data
+		zbyte *decoded = malloc(size + 1);
+		zbyte *skipped = malloc(size + 1);
+		CHECK(read_back(expected, expected_length, decoded, size, NULL));
+		CHECK(read_back(expected, expected_length, skipped, size, decoded));
+		CHECK(memcmp(skipped, decoded, size) == 0);
+		if (use_base != NULL)
+		{
+			rle_xor(decoded, base, size);
+		}
+		CHECK(memcmp(decoded, data, size) == 0);
+
+		// XOR from any alignment against byte by byte
+		zbyte *xored = malloc(size + 4);
+		zbyte *x = xored + rand() % 4;
+		memcpy(x, data, size);
+		rle_xor(x, base, size);
+		bool same = true;
+		for (size_t i = 0; i < size; i++)
+		{
+			same = same && x[i] == (data[i] ^ base[i]);
+		}
+		CHECK(same);
+
+		free(data_block);
+		free(base_block);
+		free(expected);
+		free(coded);
+		free(decoded);
+		free(skipped);
+		free(xored);
+		if (test_failures > 0)
+		{
+			fprintf(stderr, "buffer %d of %zu bytes\n", t, size);
+			break;
+		}
+	}
+	return test_result();
+}
@@ -0,0 +1,240 @@
+//
+// test_soak.c - the port's work at each prompt, for 10,000 turns
+//
+// Each turn changes dynamic memory as a game does, then does what the port
+// does at the prompt: autosave, and now and then a quick save or restore. The
+// heap in use must not grow, and the last autosave must resume. Frotz's save
+// and restore are stood in for by a Quetzal writer and reader of UMem. Each
+// prompt reads into other buffers, as a game may.
+//
+
+#include <string.h>
+#include <sys/stat.h>
+
+#include "host.h"
+#include "quetzal.h"
+
+#define TURNS (10000)
+#define DYNAMIC_SIZE (0x6000)
+#define SAVE_DIR "soak"
+
+static zbyte dynamic[DYNAMIC_SIZE];
+static zbyte screen_state[4 + MAX_SCREEN_WIDTH * SCREEN_HEIGHT * 2];
+uint8_t columns = 40;
+
+// The screen is a buffer, the port only copies it
+size_t screen_state_size(void)
+{
+	return sizeof(screen_state);
+}
+
+void screen_state_get(zbyte *state)
+{
+	memcpy(state, screen_state, sizeof(screen_state));
+}
+
+bool screen_state_set(const zbyte *state)
+{
+	memcpy(screen_state, state, sizeof(screen_state));
+	return true;
+}
+
+void show_message(const char *UNUSED(text))
+{
+}
+
+void hide_message(void)
+{
+}
+
+zchar os_read_key(int UNUSED(timeout), bool UNUSED(show_cursor))
+{
+	return ZC_RETURN;
+}
+
+void os_beep(int UNUSED(number))
+{
+}
+
+void os_fatal(const char *s, ...)
+{
+	fprintf(stderr, "fatal: %s\n", s);
+	exit(1);
+}
+
+void restart_header(void)
+{
+}
+
+void split_window(zword UNUSED(height))
+{
+}
+
+// Save as Frotz does, leaving the file just after the length of the FORM
+zword save_quetzal(FILE *svf, FILE *UNUSED(stf))
+{
+	static const zbyte ifhd[13] = {0, 1, '2', '6', '1', '0', '1', '8'};
+	static const zbyte stks[10] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 4};
+
+	bool written = fwrite("FORM\0\0\0\0IFZS", 1, 12, svf) == 12 &&
+				   iff_write_header(svf, "IFhd", sizeof(ifhd)) && fwrite(ifhd, 1, sizeof(ifhd), svf) == sizeof(ifhd) &&
+				   fputc(0, svf) != EOF &&
+				   iff_write_header(svf, "UMem", DYNAMIC_SIZE) && fwrite(zmp, 1, DYNAMIC_SIZE, svf) == DYNAMIC_SIZE &&
+				   iff_write_header(svf, "Stks", sizeof(stks)) && fwrite(stks, 1, sizeof(stks), svf) == sizeof(stks);
+	long size = ftell(svf);
+	zbyte length[4];
+	iff_put32(length, size - 8);
+	return written && fseek(svf, 4, SEEK_SET) == 0 && fwrite(length, 1, 4, svf) == 4;
+}
+
+// Restore UMem; a file that is not a save fails part way, as Frotz's can
+zword restore_quetzal(FILE *svf, FILE *UNUSED(stf))
+{
+	zbyte data[DYNAMIC_SIZE + 256];
+	size_t chunk_size;
+
+	size_t size = fread(data, 1, sizeof(data), svf);
+	const zbyte *umem = size > 12 && memcmp(data, "FORM", 4) == 0
+							? iff_find_chunk(data + 12, size - 12, "UMem", &chunk_size)
+							: NULL;
+	if (umem == NULL || iff_get32(umem + 4) != DYNAMIC_SIZE)
+	{
+		memset(zmp, 0xEE, 64);
+		return -1;
+	}
+	memcpy(zmp, umem + 8, DYNAMIC_SIZE);
+	return 2;
+}
+
+// A turn changes the globals and some object properties, always the same
+// amount, so that every snapshot and delta stays about the same size
+static void play(unsigned turn)
+{
+	for (int i = 0; i < 0x800; i++)
+	{
+		dynamic[64 + i] = rand() | 1;
+	}
+	for (int i = 0; i < 16; i++)
+	{
+		dynamic[0x1000 + (turn % 64) * 0x100 + i] = turn % 2 ? rand() | 1 : 0;
+	}
+	screen_state[4 + turn % (sizeof(screen_state) - 4)] = turn;
+}
+
+// The read going on at the prompt of a turn
+static void read_begin(unsigned turn)
+{
+	zargs[0] = 0x100 + turn % 50;
+	zargs[1] = 0x200 + turn % 50;
+	zargs[2] = 0;
+	quick_read_begin(20 + turn % 50);
+}
+
+int main(void)
+{
+	zbyte quick[2][DYNAMIC_SIZE];
+	unsigned quick_turn[2] = {0};
+	zbyte autosaved[DYNAMIC_SIZE];
+	heap_stats_t stats;
+	size_t peak = 0;
+
+	mkdir(SAVE_DIR, 0777);
+	remove(SAVE_DIR "/autosave.log");
+	remove(SAVE_DIR "/autosave.tmp");
+	f_setup.restricted_path = SAVE_DIR;
+	z_header.dynamic_size = DYNAMIC_SIZE;
+	zmp = dynamic;
+	memcpy(dynamic, host_story(V5, 1, DYNAMIC_SIZE, DYNAMIC_SIZE, 1), DYNAMIC_SIZE);
+
+	autosave_init(1);
+	for (unsigned turn = 1; turn <= TURNS; turn++)
+	{
+		play(turn);
+		read_begin(turn);
+		autosave_turn();
+		memcpy(autosaved, dynamic, DYNAMIC_SIZE);
+
+		if (turn % 7 == 0)
+		{
+			CHECK(quick_save(turn / 7 % 2));
+			memcpy(quick[turn / 7 % 2], dynamic, DYNAMIC_SIZE);
+			quick_turn[turn / 7 % 2] = turn;
+		}
+		if (turn % 13 == 0 && turn > 14)
+		{
+			int slot = turn / 13 % 2;
+			CHECK(quick_restore(slot));
+			CHECK(memcmp(dynamic, quick[slot], DYNAMIC_SIZE) == 0);
+
+			// The line goes to the buffers of the read saved
+			CHECK(zargs[0] == 0x100 + quick_turn[slot] % 50 && zargs[1] == 0x200 + quick_turn[slot] % 50);
+			CHECK(quick_read_max() == (int)(20 + quick_turn[slot] % 50));
+			memcpy(autosaved, dynamic, DYNAMIC_SIZE);
+			autosave_turn(); // The restored game is autosaved at the next prompt
+			memcpy(autosaved, dynamic, DYNAMIC_SIZE);
+		}
+
+		// As at the first prompt, once both slots are in use
+		if (turn == 100)
+		{
+			heap_sample();
+		}
+		if (turn == 1000)
+		{
+			heap_stats(&stats);
+			peak = stats.peak;
+		}
+	}
+
+	// Nothing is left behind from one turn to the next, and the heap does not
+	// keep growing from fragments
+	heap_stats(&stats);
+	printf("in use %zu, growth %ld, peak %zu\n", stats.in_use, stats.growth, stats.peak);
+	CHECK(stats.growth < 4096);
+	CHECK(stats.peak <= peak + 64 * 1024);
+
+	// A damaged save leaves the game as it was
+	memcpy(quick[0], dynamic, DYNAMIC_SIZE);
+	CHECK(quick_image_restore((const zbyte *)"FORM\0\0\0\4IFZS", 12) == -1);
+	CHECK(memcmp(dynamic, quick[0], DYNAMIC_SIZE) == 0);
+
+	// A game saved in a timed read is only restored in the same one
+	read_begin(1);
+	zargs[2] = 10;
+	zargs[3] = 0x1234;
+	CHECK(quick_save(0));
+	memcpy(quick[0], dynamic, DYNAMIC_SIZE);
+	play(1);
+	zargs[2] = 0;
+	CHECK(!quick_restore(0));
+	CHECK(memcmp(dynamic, quick[0], DYNAMIC_SIZE) != 0);
+	zargs[2] = 10;
+	zargs[3] = 0x4321;
+	CHECK(!quick_restore(0));
+	zargs[3] = 0x1234;
+	CHECK(quick_restore(0));
+	CHECK(memcmp(dynamic, quick[0], DYNAMIC_SIZE) == 0);
+
+	// The log of 10,000 autosaves resumes to the last one, in its read
+	memset(dynamic, 0, DYNAMIC_SIZE);
+	read_begin(1);
+	CHECK(autosave_resume(SAVE_DIR));
+	CHECK(autosave_restore());
+	CHECK(memcmp(dynamic, autosaved, DYNAMIC_SIZE) == 0);
+	CHECK(zargs[0] == 0x100 + TURNS % 50 && quick_read_max() == 20 + TURNS % 50);
+
+	// Power lost as the log was written again: removed, the new one not yet
+	// renamed, or only started in its place
+	CHECK(rename(SAVE_DIR "/autosave.log", SAVE_DIR "/autosave.tmp") == 0);
+	memset(dynamic, 0, DYNAMIC_SIZE);
+	CHECK(autosave_resume(SAVE_DIR) && autosave_restore());
+	CHECK(memcmp(dynamic, autosaved, DYNAMIC_SIZE) == 0);
+	CHECK(host_write_file(SAVE_DIR "/autosave.log", "ASvF", 4));
+	memset(dynamic, 0, DYNAMIC_SIZE);
+	CHECK(autosave_resume(SAVE_DIR) && autosave_restore());
+	CHECK(memcmp(dynamic, autosaved, DYNAMIC_SIZE) == 0);
+	remove(SAVE_DIR "/autosave.tmp");
+	CHECK(!autosave_resume(SAVE_DIR));
+
+	return test_result();
+}
@@ -0,0 +1,86 @@
+//
+// test_story.c - dynamic memory read again from the snapshot is as loaded
+//
+
+#include <string.h>
+
+#include "host.h"
+
+static zbyte memory[0x20000];
+
+static void progress(int UNUSED(percent))
+{
+}
+
+// Load as the core does: the header, then the whole story
+static bool load(FILE *file, long length)
+{
+	return fseek(file, 0, SEEK_SET) == 0 && fread(memory, 1, 64, file) == 64 &&
+		   fread(memory + 64, 1, length - 64, file) == (size_t)length - 64;
+}
+
+static void check_story(const char *path, int version, int release, long length, long dynamic_size, unsigned seed)
+{
+	zbyte *story = host_story(version, release, length, dynamic_size, seed);
+	CHECK(host_write_file(path, story, length));
+
+	FILE *file = story_open(path);
+	CHECK(file != NULL);
+	if (file == NULL)
+	{
+		free(story);
+		return;
+	}
+	CHECK(load(file, length));
+	CHECK(memcmp(memory, story, length) == 0);
+	story_loaded(dynamic_size);
+
+	// Restart reads dynamic memory again from the start, in one go
+	memset(memory, 0xAA, dynamic_size);
+	CHECK(fseek(file, 0, SEEK_SET) == 0 && fread(memory, 1, dynamic_size, file) == (size_t)dynamic_size);
+	CHECK(memcmp(memory, story, dynamic_size) == 0);
+
+	// Restore reads it a byte at a time, as it undoes the XOR of CMem
+	CHECK(fseek(file, 0, SEEK_SET) == 0);
+	bool same = true;
+	for (long i = 0; i < dynamic_size; i++)
+	{
+		same = same && fgetc(file) == story[i];
+	}
+	CHECK(same);
+
+	// From anywhere, and on past the end of dynamic memory
+	long starts[] = {dynamic_size - 1, 1, dynamic_size / 2, 0, dynamic_size - 100};
+	for (size_t i = 0; i < sizeof(starts) / sizeof(starts[0]); i++)
+	{
+		long n = MIN(4096, length - starts[i]);
+		memset(memory, 0xAA, n);
+		CHECK(fseek(file, starts[i], SEEK_SET) == 0 && fread(memory, 1, n, file) == (size_t)n);
+		CHECK(memcmp(memory, story + starts[i], n) == 0);
+	}
+
+	// And again after a restart
+	CHECK(load(file, length));
+	CHECK(memcmp(memory, story, length) == 0);
+
+	fclose(file);
+	free(story);
+}
+
+int main(void)
+{
+	host_store_erase();
+
+	check_story("small.z3", V3, 1, 0x8000, 0x1000, 1);
+	check_story("story.z5", V5, 1, 0x1C000, 0x9E40, 2);
+	check_story("large.z8", V8, 1, 0x20000, 0xFFF8, 3);
+
+	// Installed in flash, dynamic memory is still read from the snapshot
+	zbyte *story = host_story(V5, 7, 0x10000, 0x4321, 4);
+	CHECK(host_write_file("flash.z5", story, 0x10000));
+	CHECK(flash_install_story("flash.z5", progress) == FLASH_INSTALLED);
+	free(story);
+	check_story("flash.z5", V5, 7, 0x10000, 0x4321, 4);
+
+	return test_result();
+}
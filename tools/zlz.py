@@ -0,0 +1,182 @@
+#!/usr/bin/env python3
+#
+# zlz.py - pack a Z-machine story for the PicoCalc
+#
+# A packed story (.zlz) is read in less time from the SD card. It is split in
+# blocks compressed with LZ4, so the PicoCalc can read any part of the story
+# without decompressing what comes before it.
+#
+#   offset  size  contents
+#   0       4     "ZLZ1"
+#   4       4     length of the story
+#   8       4     bytes of story in each block
+#   12      4     number of blocks (n)
+#   16      4n+4  offset of each block in the file, then the end of the file
+#   ...           the blocks
+#
+# Numbers are little endian. A block that does not compress is stored as is,
+# and is then the same length as the story it holds.
+#
+
+import argparse
+import os
+import struct
+import sys
+import time
+
+MAGIC = b"ZLZ1"
+MIN_MATCH = 4
+MAX_OFFSET = 0xFFFF
+
+
+def _length(out, n):
+    while n >= 255:
+        out.append(255)
+        n -= 255
+    out.append(n)
+
+
+def _sequence(out, literals, offset=0, match=0):
+    lit = len(literals)
+    token = min(lit, 15) << 4
+    if offset:
+        token |= min(match - MIN_MATCH, 15)
+    out.append(token)
+    if lit >= 15:
+        _length(out, lit - 15)
+    out += literals
+    if offset:
+        out += struct.pack("<H", offset)
+        if match - MIN_MATCH >= 15:
+            _length(out, match - MIN_MATCH - 15)
+
+
+def compress_block(data):
+    """Compress a block in the LZ4 block format (greedy matching)."""
+    n = len(data)
+    out = bytearray()
+    table = {}
+    anchor = 0
+    i = 0
+    # As required by LZ4, the last 5 bytes are literals and no match starts
+    # in the last 12 bytes
+    limit = n - 12
+    while i < limit:
+        key = data[i:i + MIN_MATCH]
+        candidate = table.get(key)
+        table[key] = i
+        if candidate is None or i - candidate > MAX_OFFSET:
+            i += 1
+            continue
+        match = MIN_MATCH
+        while i + match < n - 5 and data[candidate + match] == data[i + match]:
+            match += 1
+        _sequence(out, data[anchor:i], i - candidate, match)
+        i += match
+        anchor = i
+    _sequence(out, data[anchor:])
+    return bytes(out)
+
+
+def decompress_block(data, length):
+    """Decompress an LZ4 block, to check the packed story."""
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        token = data[i]
+        i += 1
+        lit = token >> 4
+        if lit == 15:
+            while True:
+                b = data[i]
+                i += 1
+                lit += b
+                if b != 255:
+                    break
+        out += data[i:i + lit]
+        i += lit
+        if i == len(data):
+            break
+        offset = data[i] | (data[i + 1] << 8)
+        i += 2
+        match = token & 0x0F
+        if match == 15:
+            while True:
+                b = data[i]
+                i += 1
+                match += b
+                if b != 255:
+                    break
+        match += MIN_MATCH
+        for _ in range(match):
+            out.append(out[-offset])
+    if len(out) != length:
+        raise ValueError("block decompressed to %d bytes, expected %d" % (len(out), length))
+    return bytes(out)
+
+
+def pack(story, block_size):
+    blocks = []
+    for start in range(0, len(story), block_size):
+        raw = story[start:start + block_size]
+        packed = compress_block(raw)
+        blocks.append(packed if len(packed) < len(raw) else raw)
+
+    count = len(blocks)
+    offset = 16 + 4 * (count + 1)
+    offsets = []
+    for block in blocks:
+        offsets.append(offset)
+        offset += len(block)
+    offsets.append(offset)
+
+    header = MAGIC + struct.pack("<III", len(story), block_size, count)
+    return header + struct.pack("<%dI" % (count + 1), *offsets) + b"".join(blocks)
+
+
+def unpack(data):
+    if data[:4] != MAGIC:
+        raise ValueError("not a packed story")
+    length, block_size, count = struct.unpack_from("<III", data, 4)
+    offsets = struct.unpack_from("<%dI" % (count + 1), data, 16)
+    story = bytearray()
+    for i in range(count):
+        block = data[offsets[i]:offsets[i + 1]]
+        expected = min(block_size, length - i * block_size)
+        story += block if len(block) == expected else decompress_block(block, expected)
+    return bytes(story)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Pack a Z-machine story for the PicoCalc.")
+    parser.add_argument("story", help="story file (.z1 to .z8)")
+    parser.add_argument("-o", "--output", help="packed story (default: the story with a .zlz extension)")
+    parser.add_argument("-b", "--block-size", type=int, default=4096,
+                        help="bytes of story in each block (default: 4096)")
+    args = parser.parse_args()
+
+    if args.block_size < 256 or args.block_size > 65536:
+        parser.error("the block size must be between 256 and 65536")
+
+    with open(args.story, "rb") as f:
+        story = f.read()
+
+    started = time.perf_counter()
+    packed = pack(story, args.block_size)
+    packing = time.perf_counter() - started
+
+    started = time.perf_counter()
+    if unpack(packed) != story:
+        sys.exit("%s: the packed story does not match, not written" % args.story)
+    checking = time.perf_counter() - started
+
+    output = args.output or os.path.splitext(args.story)[0] + ".zlz"
+    with open(output, "wb") as f:
+        f.write(packed)
+
+    print("%s: %d -> %d bytes (%.1f%%), packed in %.2fs, checked in %.2fs" %
+          (output, len(story), len(packed), 100.0 * len(packed) / max(len(story), 1), packing, checking))
+
+
+if __name__ == "__main__":
+    main()